@@ -0,0 +1,55 @@
+#include "librf/librf.h"
+#include <tclap/CmdLine.h>
+#include <iostream>
+#include <fstream>
+
+using namespace std;
+using namespace librf;
+using namespace TCLAP;
+int main(int argc, char*argv[]) {
+  // Check arguments
+  try {
+    CmdLine cmd("rf-convert", ' ', "0.1");
+    ValueArg<string> inArg("i", "input", "Model file (text or binary)",
+                           true, "", "rfmodel");
+    ValueArg<string> outArg("o", "output", "Converted model file", true, "",
+                            "rfmodel");
+    SwitchArg textFlag("", "text", "Write a text model (default binary)",
+                       false);
+    cmd.add(textFlag);
+    cmd.add(outArg);
+    cmd.add(inArg);
+    cmd.parse(argc, argv);
+    string infile = inArg.getValue();
+    string outfile = outArg.getValue();
+    bool text = textFlag.getValue();
+
+    FlatForest* flat = NULL;
+    if (FlatForest::is_binary(infile)) {
+      flat = FlatForest::load_binary(infile);
+    } else {
+      RandomForest rf;
+      ifstream in(infile.c_str());
+      rf.read(in);
+      flat = new FlatForest(rf);
+    }
+    if (flat == NULL) {
+      return 1;
+    }
+    if (text) {
+      ofstream out(outfile.c_str());
+      flat->write_text(out);
+    } else {
+      ofstream out(outfile.c_str(), ios::binary);
+      flat->write_binary(out);
+    }
+    cout << "Converted " << flat->num_trees() << " trees ("
+         << flat->num_split_nodes() << " split nodes)" << endl;
+    delete flat;
+  }
+  catch (TCLAP::ArgException &e)  // catch any exceptions
+  {
+    cerr << "error: " << e.error() << " for arg " << e.argId() << endl;
+  }
+  return 0;
+}
@@ -39,6 +39,9 @@ int main(int argc, char*argv[]) {
 
     int num_features = numfeaturesArg.getValue();
     InstanceSet* set =  InstanceSet::load_csv_and_labels(datafile, labelfile, header, delim);
+    if (set == NULL) {
+      return 1;
+    }
     ifstream in(rankingfile.c_str());
     vector<int> topn;
     for (int i = 0; i < num_features; ++i) {
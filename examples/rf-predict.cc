@@ -3,14 +3,30 @@
 #include <tclap/CmdLine.h>
 #include <iostream>
 #include <fstream>
+#include <algorithm>
+#include <math.h>
 
 using namespace std;
 using namespace librf;
 using namespace TCLAP;
+
+// (rows: true label, columns: predicted label)
+static void print_confusion(const InstanceSet& set,
+                            const vector<int>& predictions) {
+  int matrix[2][2] = {{0, 0}, {0, 0}};
+  for (int i = 0; i < set.size(); ++i) {
+    matrix[set.label(i)][predictions[i]]++;
+  }
+  for (int i = 0; i < 2; ++i) {
+    cout << matrix[i][0] << " " << matrix[i][1] << " " << endl;
+  }
+}
+
 int main(int argc, char*argv[]) {
   // Check arguments
   try {
     SwitchArg headerFlag("","header","CSV file has a var name header",false);
+    SwitchArg libsvmFlag("","libsvm","Data is a (sparse) libsvm file",false);
     ValueArg<string> delimArg("","delim","CSV delimiter", false,",","delimiter");
     ValueArg<string> labelArg("l", "label",
                               "Label file", false, "", "labels");
@@ -24,11 +40,16 @@ int main(int argc, char*argv[]) {
     ValueArg<int> numfeaturesArg("f", "features", "# features", false,
                                  -1, "int");
     ValueArg<string> outputArg("o", "output", "predictions", true, "", "output");
+    ValueArg<int> threadsArg("", "threads",
+                             "# threads (0 = one per processor)", false,
+                             1, "int");
     cmd.add(delimArg);
     cmd.add(headerFlag);
+    cmd.add(libsvmFlag);
     cmd.add(labelArg);
     cmd.add(outputArg);
     cmd.add(numfeaturesArg);
+    cmd.add(threadsArg);
     cmd.add(dataArg);
     cmd.add(modelArg);
     cmd.parse(argc, argv);
@@ -40,23 +61,62 @@ int main(int argc, char*argv[]) {
     string outfile = outputArg.getValue();
 
     int num_features = numfeaturesArg.getValue();
+    int num_threads = threadsArg.getValue();
     InstanceSet* set = NULL;
-    set = InstanceSet::load_csv_and_labels(datafile, labelfile, header, delim);
+    if (InstanceSet::is_binary(datafile)) {
+      set = InstanceSet::load_binary(datafile);
+      if (set == NULL) {
+        return 1;
+      }
+    } else if (libsvmFlag.getValue()) {
+      set = InstanceSet::load_libsvm(datafile, num_features);
+    } else {
+      set = InstanceSet::load_csv_and_labels(datafile, labelfile, header,
+                                             delim, num_threads);
+    }
+    if (set == NULL) {
+      return 1;
+    }
 
-    RandomForest rf;
-    ifstream in(modelfile.c_str());
-    rf.read(in);
-    cout << "Test accuracy: " << rf.testing_accuracy(*set) << endl;;
+    // predictions and probabilities of label 0, from a text model or
+    // straight from a mapped binary one (see rf-convert)
+    int n = set->size();
+    vector<int> predictions(n);
+    vector<float> probs(n);
+    if (FlatForest::is_binary(modelfile)) {
+      FlatForest* flat = FlatForest::load_binary(modelfile);
+      if (flat == NULL) {
+        return 1;
+      }
+      if (n > 0) {
+        flat->predict_batch(*set, 0, n, &predictions[0], &probs[0], 0,
+                            num_threads);
+      }
+      delete flat;
+    } else {
+      RandomForest rf;
+      ifstream in(modelfile.c_str());
+      rf.read(in);
+      if (n > 0) {
+        rf.predict_batch(*set, 0, n, &predictions[0], num_threads);
+        rf.predict_prob_batch(*set, 0, n, 0, &probs[0], num_threads);
+      }
+    }
+    int correct = 0;
+    for (int i = 0; i < n; ++i) {
+      correct += (predictions[i] == set->label(i));
+    }
+    cout << "Test accuracy: " << float(correct) / n << endl;
     ofstream out(outfile.c_str());
-    for (int i = 0; i < set->size(); ++i) {
-      out << rf.predict_prob(*set, i, 0) << endl;
+    for (int i = 0; i < n; ++i) {
+      out << probs[i] << endl;
     }
     cout << "Confusion matrix" << endl;
-    rf.test_confusion(*set);
+    print_confusion(*set, predictions);
+    cout << "Reliability" << endl;
     vector<pair<float, float> > rd;
     vector<int> hist;
-    cout << "Reliability" << endl;
-    rf.reliability_diagram(*set, 10, &rd, &hist, 0);
+    RandomForest::reliability_diagram(*set, probs, 10, &rd, &hist, 0);
     cout << "bin fraction 1 0 total" << endl;
     for (int i = 0; i < rd.size(); ++i) {
       int positive = int(round(hist[i]*rd[i].second));
@@ -1,8 +1,10 @@
 #include "librf/librf.h"
+#include "librf/stringutils.h"
 #include <sstream>
 #include <tclap/CmdLine.h>
 #include <iostream>
 #include <fstream>
+#include <algorithm>
 #include <math.h>
 using namespace std;
 using namespace librf;
@@ -12,6 +14,7 @@ int main(int argc, char*argv[]) {
   try {
     CmdLine cmd("rf-train", ' ', "0.1");
     SwitchArg csvFlag("","csv","Data is a CSV file",false);
+    SwitchArg libsvmFlag("","libsvm","Data is a (sparse) libsvm file",false);
     SwitchArg headerFlag("","header","CSV file has a var name header",false);
     ValueArg<string> delimArg("","delim","CSV delimiter", false,",","delimiter");
     ValueArg<string>  dataArg("d", "data",
@@ -25,33 +28,115 @@ int main(int argc, char*argv[]) {
     ValueArg<int> treesArg("t", "trees", "# Trees", false, 10, "int");
     ValueArg<int> kArg("k", "vars", "# vars per tree", false,
                                  -1, "int");
+    ValueArg<int> binsArg("", "bins", "bin the data (max # bins, <= 256)",
+                          false, 0, "int");
+    ValueArg<int> threadsArg("", "threads", "# threads (0 = all processors)",
+                             false, 1, "int");
     ValueArg<string> probArg("p", "probfile",
                               "probability file", false, "", "probfile");
     ValueArg<string> proxArg("", "proxfile",
                               "proximity file", false, "", "proxfile");
+    ValueArg<int> proxtopArg("", "proxtop",
+                             "keep the k largest proximities per instance",
+                             false, 0, "int");
+    ValueArg<string> proxformatArg("", "proxformat",
+                                   "proximity file format: text, float "
+                                   "or uint16", false, "text", "format");
+    ValueArg<int> isolationArg("", "isolation",
+                               "outlier scores from an isolation forest "
+                               "grown on samples of this size (0 = from "
+                               "the proximities)", false, 0, "int");
     ValueArg<string> outliersArg("", "outliers", "outlier file", false, "outliers", "outlierfile");
+    ValueArg<string> savedataArg("", "savedata",
+                                 "save the loaded data as a binary file",
+                                 false, "", "datafile");
     ValueArg<string> importArg("","importance", "importance", false, "", "importance");
+    ValueArg<string> impurityArg("", "impurity",
+                                 "impurity (mean decrease) importance",
+                                 false, "", "importance");
+    SwitchArg giniFlag("", "gini", "Split on gini impurity (default: entropy)",
+                       false);
+    ValueArg<float> bagfractionArg("", "bagfraction",
+                                   "bag size as a fraction of the data",
+                                   false, 1.0, "float");
+    SwitchArg noreplaceFlag("", "noreplace",
+                            "draw bags without replacement", false);
+    ValueArg<string> baggingArg("", "bagging",
+                                "bag sampling: random, stratified or "
+                                "balanced", false, "random", "sampling");
+    ValueArg<string> weightsArg("", "weights",
+                                "sample weight file (one per instance)",
+                                false, "", "weights");
+    ValueArg<string> classweightsArg("", "classweights",
+                                     "class weights (ex. 1,20)",
+                                     false, "", "list");
     SwitchArg unsuperFlag("", "unsupervised", "Unsupervised mode", false);
 
     cmd.add(outliersArg);
+    cmd.add(isolationArg);
+    cmd.add(savedataArg);
     cmd.add(unsuperFlag);
+    cmd.add(giniFlag);
+    cmd.add(bagfractionArg);
+    cmd.add(noreplaceFlag);
+    cmd.add(baggingArg);
+    cmd.add(weightsArg);
+    cmd.add(classweightsArg);
     cmd.add(delimArg);
     cmd.add(importArg);
+    cmd.add(impurityArg);
     cmd.add(headerFlag);
     cmd.add(csvFlag);
+    cmd.add(libsvmFlag);
     cmd.add(labelArg);
     cmd.add(numfeaturesArg);
     cmd.add(dataArg);
     cmd.add(modelArg);
     cmd.add(treesArg);
     cmd.add(kArg);
+    cmd.add(threadsArg);
+    cmd.add(binsArg);
     cmd.add(probArg);
     cmd.add(proxArg);
+    cmd.add(proxtopArg);
+    cmd.add(proxformatArg);
     cmd.parse(argc, argv);
 
     bool csv = csvFlag.getValue();
+    bool libsvm = libsvmFlag.getValue();
     bool header = headerFlag.getValue();
     bool unsupervised = unsuperFlag.getValue();
+    SplitCriterionType criterion = giniFlag.getValue() ? GINI : ENTROPY;
+    bag_options bagging;
+    bagging.fraction = bagfractionArg.getValue();
+    bagging.replacement = !noreplaceFlag.getValue();
+    string sampling = baggingArg.getValue();
+    if (sampling == "stratified") {
+      bagging.sampling = BAG_STRATIFIED;
+    } else if (sampling == "balanced") {
+      bagging.sampling = BAG_BALANCED;
+    } else if (sampling != "random") {
+      cerr << "Unknown bag sampling " << sampling << endl;
+      return 1;
+    }
+    if (bagging.fraction <= 0 ||
+        (!bagging.replacement && bagging.fraction > 1)) {
+      cerr << "Bag fraction out of range" << endl;
+      return 1;
+    }
+    vector<float> class_weights;
+    if (!classweightsArg.getValue().empty()) {
+      vector<string> fields;
+      StringUtils::split(classweightsArg.getValue(), &fields);
+      for (int i = 0; i < fields.size(); ++i) {
+        float weight = atof(fields[i].c_str());
+        if (weight < 0) {
+          cerr << "Negative class weight" << endl;
+          return 1;
+        }
+        class_weights.push_back(weight);
+      }
+    }
     string outlier_file = outliersArg.getValue();
     string delim = delimArg.getValue();
     string datafile = dataArg.getValue();
@@ -60,29 +145,86 @@ int main(int argc, char*argv[]) {
     string probfile = probArg.getValue();
     string proxfile = proxArg.getValue();
     string importfile = importArg.getValue();
+    string impurityfile = impurityArg.getValue();
+    string savedatafile = savedataArg.getValue();
     int K = kArg.getValue();
     int num_features = numfeaturesArg.getValue();
     int num_trees = treesArg.getValue();
+    if (num_trees > RandomForest::kMaxTrees) {
+      cerr << "At most " << RandomForest::kMaxTrees << " trees" << endl;
+      return 1;
+    }
+    int num_threads = threadsArg.getValue();
+    int num_bins = binsArg.getValue();
+    int prox_top = proxtopArg.getValue();
+    string prox_format = proxformatArg.getValue();
+    int isolation_sample = isolationArg.getValue();
+    if (prox_format != "text" && prox_format != "float" &&
+        prox_format != "uint16") {
+      cerr << "Unknown proximity format " << prox_format << endl;
+      return 1;
+    }
     InstanceSet* set = NULL;
     unsigned int seed = 1;
     int set_size;
-    //if (!csv) {
-      // set = InstanceSet::load_libsvm(datafile, num_features);
-    //} else {
-    if (!unsupervised) {
-      set = InstanceSet::load_csv_and_labels(datafile, labelfile, header, delim);
+    if (InstanceSet::is_binary(datafile)) {
+      // saved with --savedata (unsupervised sets include the synthetic half)
+      set = InstanceSet::load_binary(datafile);
+      if (set == NULL) {
+        return 1;
+      }
+      set_size = unsupervised ? set->size() / 2 : set->size();
+    } else if (libsvm) {
+      // labels come from the libsvm file
+      set = InstanceSet::load_libsvm(datafile, num_features);
+      if (set == NULL) {
+        return 1;
+      }
+      set_size = set->size();
+    } else if (!unsupervised) {
+      set = InstanceSet::load_csv_and_labels(datafile, labelfile, header, delim,
+                                             num_threads);
+      if (set == NULL) {
+        return 1;
+      }
       set_size = set->size();
     } else {
-      set = InstanceSet::load_unsupervised(datafile, &seed, header, delim);
+      set = InstanceSet::load_unsupervised(datafile, &seed, header, delim,
+                                           num_threads);
+      if (set == NULL) {
+        return 1;
+      }
       set_size = set->size() / 2;
     }
-    //}
+    if (!weightsArg.getValue().empty() &&
+        !set->load_weights(weightsArg.getValue())) {
+      return 1;
+    }
+    if (num_bins > 0) {
+      set->create_bins(num_bins);
+    }
+    // (the weights and bins are saved with the data)
+    if (!savedatafile.empty()) {
+      ofstream out(savedatafile.c_str(), ios::binary);
+      set->write_binary(out);
+    }
     // if mtry was not set defaults to sqrt(num_features)
     if (K == -1) {
        K = int(sqrt(double(set->num_attributes())));
     }
-    // vector<int> weights;
-    RandomForest rf(*set, num_trees, K); //, weights);
+    if (!class_weights.empty()) {
+      int num_labels = 2;
+      for (int i = 0; i < set->size(); ++i) {
+        num_labels = max(num_labels, set->label(i) + 1);
+      }
+      if (class_weights.size() != num_labels) {
+        cerr << class_weights.size() << " class weights for " << num_labels
+             << " labels" << endl;
+        return 1;
+      }
+    }
+    RandomForest rf(*set, num_trees, K, class_weights, num_threads, seed,
+                    criterion, bagging);
     cout << "Training Accuracy " << rf.training_accuracy() << endl;
     cout << "OOB Accuracy " << rf.oob_accuracy() << endl;
     cout << "---Confusion Matrix----" << endl;
@@ -108,20 +250,39 @@ int main(int argc, char*argv[]) {
         prob_out << rf.oob_predict_prob(i, 0) << endl;
       }
     }
-    if (proxfile.size() > 0) {
+    if (proxfile.size() > 0 && prox_format != "text") {
+      cout << "Writing proximity matrix" << endl;
+      int format = (prox_format == "uint16") ? PROXIMITY_UINT16
+                                             : PROXIMITY_FLOAT;
+      if (!rf.write_proximity(*set, proxfile, set_size, format,
+                              num_threads)) {
+        return 1;
+      }
+    } else if (proxfile.size() > 0) {
       cout << "Generating proximity matrix" << endl;
       ofstream prox_out(proxfile.c_str());
-      vector<vector<float> > mat(set_size, vector<float>(set_size, 0.0));
-      rf.compute_proximity(*set, &mat, set_size);
-      for (int i = 0; i < mat.size(); ++i) {
-        for (int j = 0; j < mat[i].size(); ++j) {
-          prox_out << mat[i][j] << " ";
+      ProximityMatrix prox;
+      rf.compute_proximity(*set, &prox, set_size, prox_top, num_threads);
+      for (int i = 0; i < prox.size(); ++i) {
+        prox.write_dense_row(prox_out, i);
+      }
+      if (isolation_sample <= 0) {
+        ofstream out_file(outlier_file.c_str());
+        vector<pair<float, int> >outliers;
+        rf.compute_outliers(*set, 0, prox, &outliers);
+        for (int i = 0; i < outliers.size(); ++i) {
+          out_file << outliers[i].second << " " << outliers[i].first << endl;
         }
-        prox_out << endl;
       }
+    }
+    if (isolation_sample > 0) {
+      cout << "Growing isolation forest" << endl;
+      // (only the real instances of an unsupervised set)
+      IsolationForest iforest(*set, num_trees, isolation_sample, set_size,
+                              num_threads, seed);
       ofstream out_file(outlier_file.c_str());
       vector<pair<float, int> >outliers;
-      rf.compute_outliers(*set, 0, mat, &outliers);
+      iforest.compute_outliers(*set, &outliers, set_size, num_threads);
       for (int i = 0; i < outliers.size(); ++i) {
         out_file << outliers[i].second << " " << outliers[i].first << endl;
       }
@@ -130,7 +291,19 @@ int main(int argc, char*argv[]) {
     if (importfile.size() > 0) {
       ofstream rankings(importfile.c_str());
       vector< pair<float, int> > scores;
-      rf.variable_importance(&scores, &seed);
+      rf.variable_importance(&scores, &seed, num_threads);
+      for (int i = 0; i < scores.size(); ++i) {
+        rankings << scores[i].second << " " << scores[i].first << endl;
+      }
+    }
+    if (impurityfile.size() > 0) {
+      ofstream rankings(impurityfile.c_str());
+      const vector<float>& importance = rf.impurity_importance();
+      vector< pair<float, int> > scores;
+      for (int i = 0; i < importance.size(); ++i) {
+        scores.push_back(make_pair(importance[i], i));
+      }
+      sort(scores.begin(), scores.end(), greater<pair<float, int> >());
       for (int i = 0; i < scores.size(); ++i) {
         rankings << scores[i].second << " " << scores[i].first << endl;
       }
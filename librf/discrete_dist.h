@@ -7,6 +7,7 @@ Discrete distribution
 #include <vector>
 #include <iostream>
 #include <math.h>
+#include <assert.h>
 #include "librf/types.h"
 
 using namespace std;
@@ -25,22 +26,30 @@ class DiscreteDist {
     /*~DiscreteDist() {
       //delete [] counter_;
     }*/
-    void add(int value, unsigned int weight=1) {
+    /// Weights can be fractional (ex. class or sample weights)
+    void add(int value, double weight=1) {
       counter_[value] += weight;
       sum_ += weight;
     }
-    void remove(int value, unsigned int weight=1) {
+    void remove(int value, double weight=1) {
       counter_[value] -= weight;
       sum_ -= weight;
     }
-    unsigned int sum() const {
+    /// Zero all the counts (keeps the number of labels)
+    void clear() {
+      for (int i = 0; i < size_; ++i) {
+        counter_[i] = 0;
+      }
+      sum_ = 0;
+    }
+    double sum() const {
       return sum_;
     }
     int mode() const {
-      int max = -1;
+      double max = -1;
       int mode = -10;
       for (int i = 0; i< size_; ++i) {
-        int val = counter_[i];
+        double val = counter_[i];
         if (val > max) {
           max = val;
           mode = i;
@@ -50,16 +59,20 @@ class DiscreteDist {
     }
     void print() {
       for (int i = 0; i < size_; ++i) {
-        cout << i << ":" << int(counter_[i]) << endl;
+        cout << i << ":" << counter_[i] << endl;
       }
     }
 		unsigned int num_labels() const {
 			return size_;
 		}
-		unsigned int weight(int i) const {
+		double weight(int i) const {
 			return counter_[i];
 		}
+    /// Fraction of the weight on label i (0 if empty)
     float percentage(int i) const {
+      if (sum() == 0) {
+        return 0;
+      }
       return float(weight(i)) / sum();
     }
 		static const double kLog2;
@@ -126,8 +139,31 @@ class DiscreteDist {
 			}
 			return (returnValue + lnFunc(total)) / (total * kLog2);
 		}
+    /// Gini impurity (1 - sum of squared label probabilities)
+    float gini() const {
+      if (sum_ == 0) {
+        return 0;
+      }
+      double sum_sq = 0;
+      for (int i = 0; i < size_; ++i) {
+        sum_sq += double(counter_[i]) * counter_[i];
+      }
+      return 1.0 - sum_sq / (double(sum_) * sum_);
+    }
+    /// Impurity under the given criterion
+    float impurity(SplitCriterionType criterion) const {
+      return (criterion == GINI) ? gini() : entropy_over_classes();
+    }
+    /// table[w] = w ln(w) for w = 0..n (used by SplitImpurity)
+    static void nlogn_table(int n, vector<double>* table) {
+      table->resize(n + 1);
+      (*table)[0] = 0;
+      for (int w = 1; w <= n; ++w) {
+        (*table)[w] = w * log(double(w));
+      }
+    }
   private:
-    unsigned int sum_;
+    double sum_;
     unsigned int size_;
   static float lnFunc(float num) {
 			if (num  < 1e-6) {
@@ -136,8 +172,98 @@ class DiscreteDist {
 				return num * log(num);
 			}
 		}
-    vector<unsigned int> counter_;
+    vector<double> counter_;
     //unsigned int* counter_;
 };
+
+/**
+ * Impurity of a two way split, updated incrementally.
+ * Everything starts on the right, and instances are moved to the left
+ * one at a time (as a split point scans through a sorted attribute).
+ * Each move is O(1):
+ *  - entropy keeps a running sum of w ln(w) over the labels of each side,
+ *    looked up in a table when the weights are small integers, computed
+ *    otherwise
+ *  - gini keeps a running sum of w^2 over the labels of each side
+ */
+class SplitImpurity {
+  public:
+    /// nlogn from DiscreteDist::nlogn_table (big enough for any weight),
+    /// or NULL if the weights are not all integers
+    SplitImpurity(SplitCriterionType criterion,
+                  const vector<double>* nlogn = NULL)
+        : criterion_(criterion), nlogn_(nlogn) {}
+    /// Change the table (ex. once the weights are known)
+    void set_nlogn_table(const vector<double>* nlogn) {
+      nlogn_ = nlogn;
+    }
+    /// Put all of dist on the right
+    void reset(const DiscreteDist& dist) {
+      int n = dist.num_labels();
+      left_.assign(n, 0);
+      right_.resize(n);
+      left_sum_ = 0;
+      right_sum_ = dist.sum();
+      left_term_ = 0;
+      right_term_ = 0;
+      for (int i = 0; i < n; ++i) {
+        right_[i] = dist.weight(i);
+        right_term_ += term(right_[i]);
+      }
+    }
+    /// Move weight of a label from the right to the left
+    void move_left(int label, double weight) {
+      double l = left_[label];
+      double r = right_[label];
+      left_term_ += term(l + weight) - term(l);
+      right_term_ += term(r - weight) - term(r);
+      left_[label] = l + weight;
+      right_[label] = r - weight;
+      left_sum_ += weight;
+      right_sum_ -= weight;
+    }
+    /// Impurity after the split (the two sides weighted by their sums)
+    /// -- same as DiscreteDist::entropy_conditioned for ENTROPY
+    float impurity() const {
+      double total = double(left_sum_) + right_sum_;
+      if (total == 0) {
+        return 0;
+      }
+      if (criterion_ == GINI) {
+        double impurity = 0;
+        if (left_sum_ > 0) {
+          impurity += left_sum_ - left_term_ / left_sum_;
+        }
+        if (right_sum_ > 0) {
+          impurity += right_sum_ - right_term_ / right_sum_;
+        }
+        return impurity / total;
+      }
+      return (nlogn(left_sum_) - left_term_ + nlogn(right_sum_) - right_term_)
+             / (total * DiscreteDist::kLog2);
+    }
+  private:
+    double term(double weight) const {
+      if (criterion_ == GINI) {
+        return weight * weight;
+      }
+      return nlogn(weight);
+    }
+    double nlogn(double weight) const {
+      if (nlogn_ != NULL) {
+        return (*nlogn_)[int(weight + 0.5)];
+      }
+      // (differences of sums can be a rounding error below 0)
+      return (weight > 0) ? weight * log(weight) : 0;
+    }
+    SplitCriterionType criterion_;
+    const vector<double>* nlogn_;
+    vector<double> left_;
+    vector<double> right_;
+    double left_sum_;
+    double right_sum_;
+    double left_term_;
+    double right_term_;
+};
 } // namespace
 #endif
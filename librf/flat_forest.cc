@@ -0,0 +1,384 @@
+/**
+ * @file
+ * @brief FlatForest implementation
+ */
+#include "librf/flat_forest.h"
+#include "librf/random_forest.h"
+#include "librf/tree.h"
+#include "librf/instance_set.h"
+#include "librf/parallel.h"
+#include <assert.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fstream>
+#include <utility>
+#include <algorithm>
+#include <limits.h>
+
+namespace librf {
+
+// version 1 files end after the children
+const uint32 FlatForest::kVersion = 2;
+static const char kMagic[4] = {'L', 'R', 'F', 'B'};
+const int FlatForest::kPredictBlock = 256;
+
+// Arguments of a batch prediction, shared by the block workers
+struct flat_predict_context {
+  const FlatForest* forest;
+  const InstanceSet* set;
+  int begin;
+  int end;
+  int label;
+  int* labels;   // predicted labels go here (if not NULL)
+  float* probs;  // probabilities of label go here (if not NULL)
+};
+
+// Most voted label; ties go to the smaller label (as in DiscreteDist::mode)
+static int vote_mode(const unsigned int* votes, int num_labels) {
+  int mode = 0;
+  for (int i = 1; i < num_labels; ++i) {
+    if (votes[i] > votes[mode]) {
+      mode = i;
+    }
+  }
+  return mode;
+}
+
+FlatForest::FlatForest() : importances_(NULL), num_importances_(0),
+                           num_labels_(2), K_(0), map_(NULL), map_size_(0) {}
+
+FlatForest::FlatForest(const RandomForest& rf) : num_labels_(2),
+                                                 K_(rf.K()),
+                                importance_store_(rf.impurity_importance()),
+                                                 map_(NULL), map_size_(0) {
+  for (int i = 0; i < rf.num_trees(); ++i) {
+    root_store_.push_back(add_tree(rf.tree(i)));
+  }
+  point_to_storage();
+}
+
+FlatForest::~FlatForest() {
+  if (map_ != NULL) {
+    munmap(map_, map_size_);
+  }
+}
+
+void FlatForest::point_to_storage() {
+  num_trees_ = root_store_.size();
+  num_split_nodes_ = attr_store_.size();
+  roots_ = root_store_.empty() ? NULL : &root_store_[0];
+  attrs_ = attr_store_.empty() ? NULL : &attr_store_[0];
+  thresholds_ = threshold_store_.empty() ? NULL : &threshold_store_[0];
+  children_ = child_store_.empty() ? NULL : &child_store_[0];
+  num_importances_ = importance_store_.size();
+  importances_ = importance_store_.empty() ? NULL : &importance_store_[0];
+}
+
+/**
+ * Append the split nodes of a tree (depth first)
+ * @return reference to the root
+ */
+int FlatForest::add_tree(const Tree& tree) {
+  int root = 0;
+  // (tree node, slot in child_store_ to fill in -- -1 for the root)
+  vector<pair<int, int> > todo;
+  todo.push_back(make_pair(0, -1));
+  while (!todo.empty()) {
+    int n = todo.back().first;
+    int slot = todo.back().second;
+    todo.pop_back();
+    const tree_node& node = tree.node(n);
+    assert(node.status == TERMINAL || node.status == SPLIT);
+    int ref;
+    if (node.status == TERMINAL) {
+      ref = ~int(node.label);
+      if (node.label >= num_labels_) {
+        num_labels_ = node.label + 1;
+      }
+    } else {
+      ref = attr_store_.size();
+      attr_store_.push_back(node.attr);
+      threshold_store_.push_back(node.split_point);
+      child_store_.push_back(0);
+      child_store_.push_back(0);
+      // right first, so that the left subtree comes next
+      todo.push_back(make_pair(int(node.right), 2 * ref + 1));
+      todo.push_back(make_pair(int(node.left), 2 * ref));
+    }
+    if (slot < 0) {
+      root = ref;
+    } else {
+      child_store_[slot] = ref;
+    }
+  }
+  return root;
+}
+
+void FlatForest::write_binary(ostream& o) const {
+  flat_forest_header header;
+  memcpy(header.magic, kMagic, sizeof(kMagic));
+  header.version = kVersion;
+  header.num_trees = num_trees_;
+  header.num_split_nodes = num_split_nodes_;
+  header.num_labels = num_labels_;
+  header.K = K_;
+  o.write(reinterpret_cast<const char*>(&header), sizeof(header));
+  o.write(reinterpret_cast<const char*>(roots_), num_trees_ * sizeof(int));
+  o.write(reinterpret_cast<const char*>(attrs_),
+          num_split_nodes_ * sizeof(uint32));
+  o.write(reinterpret_cast<const char*>(thresholds_),
+          num_split_nodes_ * sizeof(float));
+  o.write(reinterpret_cast<const char*>(children_),
+          2 * num_split_nodes_ * sizeof(int));
+  uint32 num_importances = num_importances_;
+  o.write(reinterpret_cast<const char*>(&num_importances), sizeof(uint32));
+  o.write(reinterpret_cast<const char*>(importances_),
+          num_importances_ * sizeof(float));
+}
+
+bool FlatForest::is_binary(const string& filename) {
+  ifstream in(filename.c_str(), ios::binary);
+  char magic[4];
+  in.read(magic, sizeof(magic));
+  return in.good() && memcmp(magic, kMagic, sizeof(kMagic)) == 0;
+}
+
+/**
+ * Whether every root and child reference of a mapped model (whose size
+ * has been checked) stays in it: split nodes in range, and children
+ * after their parent (so every path ends), leaf labels below num_labels
+ * (predict counts votes in a 256 label array)
+ */
+static bool valid_refs(const void* map, const flat_forest_header* header) {
+  const int* roots = reinterpret_cast<const int*>(
+                         static_cast<const char*>(map) + sizeof(*header));
+  int num_nodes = header->num_split_nodes;
+  int num_labels = header->num_labels;
+  const int* children = roots + header->num_trees + 2 * num_nodes;
+  if (header->num_split_nodes > uint32(INT_MAX / 2)) {
+    return false;
+  }
+  for (uint32 t = 0; t < header->num_trees; ++t) {
+    int ref = roots[t];
+    if (ref >= num_nodes || (ref < 0 && ~ref >= num_labels)) {
+      return false;
+    }
+  }
+  for (int i = 0; i < 2 * num_nodes; ++i) {
+    int ref = children[i];
+    if (ref >= num_nodes || (ref >= 0 && ref <= i / 2) ||
+        (ref < 0 && ~ref >= num_labels)) {
+      return false;
+    }
+  }
+  return true;
+}
+
+/**
+ * Map a binary model read-only; the forest predicts straight from the
+ * mapped pages (they are unmapped when it is deleted)
+ */
+FlatForest* FlatForest::load_binary(const string& filename) {
+  int fd = open(filename.c_str(), O_RDONLY);
+  if (fd < 0) {
+    cerr << "Could not open " << filename << endl;
+    return NULL;
+  }
+  struct stat st;
+  if (fstat(fd, &st) != 0 || st.st_size < sizeof(flat_forest_header)) {
+    cerr << filename << " is not a binary model" << endl;
+    close(fd);
+    return NULL;
+  }
+  size_t size = st.st_size;
+  void* map = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+  // the mapping stays valid after the file is closed
+  close(fd);
+  if (map == MAP_FAILED) {
+    cerr << "Could not map " << filename << endl;
+    return NULL;
+  }
+  const flat_forest_header* header =
+                         static_cast<const flat_forest_header*>(map);
+  size_t nodes_end = sizeof(flat_forest_header) +
+                     size_t(header->num_trees) * sizeof(int) +
+                     size_t(header->num_split_nodes) *
+                     (sizeof(uint32) + sizeof(float) + 2 * sizeof(int));
+  size_t expected = nodes_end;
+  const uint32* num_importances = NULL;
+  if (header->version == kVersion && size >= nodes_end + sizeof(uint32)) {
+    num_importances = reinterpret_cast<const uint32*>(
+                          static_cast<const char*>(map) + nodes_end);
+    expected += sizeof(uint32) + size_t(*num_importances) * sizeof(float);
+  }
+  if (memcmp(header->magic, kMagic, sizeof(kMagic)) != 0 ||
+      (header->version != 1 && header->version != kVersion) ||
+      size != expected || header->num_labels > 256 ||
+      !valid_refs(map, header)) {
+    cerr << filename << " is not a version " << kVersion
+         << " binary model" << endl;
+    munmap(map, size);
+    return NULL;
+  }
+  FlatForest* forest = new FlatForest();
+  forest->map_ = map;
+  forest->map_size_ = size;
+  forest->num_trees_ = header->num_trees;
+  forest->num_split_nodes_ = header->num_split_nodes;
+  forest->num_labels_ = header->num_labels;
+  forest->K_ = header->K;
+  const char* p = static_cast<const char*>(map) + sizeof(flat_forest_header);
+  forest->roots_ = reinterpret_cast<const int*>(p);
+  p += forest->num_trees_ * sizeof(int);
+  forest->attrs_ = reinterpret_cast<const uint32*>(p);
+  p += forest->num_split_nodes_ * sizeof(uint32);
+  forest->thresholds_ = reinterpret_cast<const float*>(p);
+  p += forest->num_split_nodes_ * sizeof(float);
+  forest->children_ = reinterpret_cast<const int*>(p);
+  if (num_importances != NULL) {
+    forest->num_importances_ = *num_importances;
+    forest->importances_ = reinterpret_cast<const float*>(num_importances + 1);
+  }
+  return forest;
+}
+
+/**
+ * Write the trees back out as tree_nodes (root first, numbered
+ * breadth first), readable by RandomForest::read
+ */
+void FlatForest::write_text(ostream& o) const {
+  o << num_trees_ << " " << K_ << endl;
+  for (int t = 0; t < num_trees_; ++t) {
+    // references in the order they are numbered
+    vector<int> refs(1, roots_[t]);
+    vector<tree_node> nodes;
+    for (int i = 0; i < refs.size(); ++i) {
+      tree_node node;
+      int ref = refs[i];
+      if (ref < 0) {
+        node.status = TERMINAL;
+        node.label = uchar(~ref);
+      } else {
+        node.status = SPLIT;
+        node.attr = attrs_[ref];
+        node.split_point = thresholds_[ref];
+        node.left = refs.size();
+        node.right = refs.size() + 1;
+        refs.push_back(children_[2 * ref]);
+        refs.push_back(children_[2 * ref + 1]);
+      }
+      nodes.push_back(node);
+    }
+    o << "Tree: " << nodes.size() << endl;
+    for (int i = 0; i < nodes.size(); ++i) {
+      o << i << " ";
+      nodes[i].write(o);
+    }
+  }
+  RandomForest::write_importance(o, impurity_importance());
+}
+
+void FlatForest::vote(const InstanceSet& set, int instance_no,
+                      unsigned int* votes) const {
+  const uint32* attrs = attrs_;
+  const float* thresholds = thresholds_;
+  const int* children = children_;
+  for (int t = 0; t < num_trees_; ++t) {
+    int node = roots_[t];
+    while (node >= 0) {
+      // same test as Tree::predict (value < split point goes left)
+      bool right = !(set.get_attribute(instance_no, attrs[node]) <
+                     thresholds[node]);
+      node = children[2 * node + right];
+    }
+    votes[~node]++;
+  }
+}
+
+int FlatForest::predict(const InstanceSet& set, int instance_no) const {
+  unsigned int votes[256];
+  for (int i = 0; i < num_labels_; ++i) {
+    votes[i] = 0;
+  }
+  vote(set, instance_no, votes);
+  return vote_mode(votes, num_labels_);
+}
+
+float FlatForest::predict_prob(const InstanceSet& set, int instance_no,
+                               int label) const {
+  if (label >= num_labels_) {
+    return 0;
+  }
+  unsigned int votes[256];
+  for (int i = 0; i < num_labels_; ++i) {
+    votes[i] = 0;
+  }
+  vote(set, instance_no, votes);
+  return float(votes[label]) / num_trees_;
+}
+
+/**
+ * Tree-major, as RandomForest::vote_block: each tree is walked for
+ * the whole block before the next one, so its nodes stay in cache
+ */
+void FlatForest::vote_block(const InstanceSet& set, int begin, int end,
+                            unsigned int* votes) const {
+  const uint32* attrs = attrs_;
+  const float* thresholds = thresholds_;
+  const int* children = children_;
+  for (int t = 0; t < num_trees_; ++t) {
+    for (int i = begin; i < end; ++i) {
+      int node = roots_[t];
+      while (node >= 0) {
+        bool right = !(set.get_attribute(i, attrs[node]) < thresholds[node]);
+        node = children[2 * node + right];
+      }
+      votes[(i - begin) * num_labels_ + ~node]++;
+    }
+  }
+}
+
+void FlatForest::predict_block_task(int block, void* arg) {
+  flat_predict_context* c = static_cast<flat_predict_context*>(arg);
+  const FlatForest* forest = c->forest;
+  int num_labels = forest->num_labels_;
+  int begin = c->begin + block * kPredictBlock;
+  int end = min(begin + kPredictBlock, c->end);
+  vector<unsigned int> votes((end - begin) * num_labels, 0);
+  forest->vote_block(*c->set, begin, end, &votes[0]);
+  for (int i = begin; i < end; ++i) {
+    const unsigned int* row = &votes[(i - begin) * num_labels];
+    if (c->labels != NULL) {
+      c->labels[i - c->begin] = vote_mode(row, num_labels);
+    }
+    if (c->probs != NULL) {
+      c->probs[i - c->begin] = c->label < num_labels ?
+                               float(row[c->label]) / forest->num_trees_ : 0;
+    }
+  }
+}
+
+/**
+ * Same results as calling predict and predict_prob for each instance
+ * @param set data set
+ * @param begin first instance
+ * @param end one past the last instance
+ * @param labels caller allocated, end - begin entries (or NULL)
+ * @param probs caller allocated, end - begin entries (or NULL)
+ * @param label label of the probabilities
+ * @param num_threads #blocks of rows scored at once (<= 0: all processors)
+ */
+void FlatForest::predict_batch(const InstanceSet& set, int begin, int end,
+                               int* labels, float* probs, int label,
+                               int num_threads) const {
+  assert(0 <= begin && begin <= end && end <= set.size());
+  flat_predict_context context = {this, &set, begin, end, label,
+                                  labels, probs};
+  int num_blocks = (end - begin + kPredictBlock - 1) / kPredictBlock;
+  parallel_for(num_blocks, num_threads, predict_block_task, &context);
+}
+
+} // namespace
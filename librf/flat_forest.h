@@ -0,0 +1,131 @@
+/**
+ * @file
+ * @brief Compact forest for fast prediction
+ *
+ * A trained (or loaded) RandomForest keeps every tree as a vector of
+ * tree_node, which carries build-time fields that prediction never
+ * reads. FlatForest packs the split nodes of all the trees into a few
+ * contiguous arrays:
+ *  - attrs_[i]: split attribute of split node i
+ *  - thresholds_[i]: split point of split node i
+ *  - children_[2i], children_[2i+1]: left and right child of split node i
+ *
+ * A child (or root) reference >= 0 is another split node, a negative
+ * reference is a leaf and holds its label inline (~label).
+ * Nodes are laid out depth first, so a left child usually follows
+ * its parent.
+ *
+ * The arrays can be saved as is in a binary model file:
+ *  - header (flat_forest_header)
+ *  - tree offset table: root reference of each tree (int32)
+ *  - attrs (uint32), thresholds (float32), children (int32 pairs)
+ *  - (version 2) #impurity importances (uint32), importances (float32)
+ *
+ * Everything is 4 byte aligned, so load_binary just mmaps the file and
+ * points the arrays into it: there is nothing to parse, and processes
+ * loading the same model share one copy in the page cache.
+ * Files are written in the byte order of the host.
+ */
+#ifndef _FLAT_FOREST_H_
+#define _FLAT_FOREST_H_
+
+#include "librf/types.h"
+#include <vector>
+#include <string>
+#include <iostream>
+
+using namespace std;
+
+namespace librf {
+
+class RandomForest;
+class InstanceSet;
+class Tree;
+struct flat_predict_context;
+
+/// Header of a binary model file
+struct flat_forest_header {
+  char magic[4];          // "LRFB"
+  uint32 version;         // kVersion of the writer
+  uint32 num_trees;
+  uint32 num_split_nodes;
+  uint32 num_labels;
+  uint32 K;               // random vars per split (kept for the text format)
+};
+
+class FlatForest {
+  public:
+    /// Pack the trees of a random forest
+    FlatForest(const RandomForest& rf);
+    ~FlatForest();
+    /// Map a binary model file (NULL if it is not a valid model)
+    static FlatForest* load_binary(const string& filename);
+    /// Does the file start like a binary model?
+    static bool is_binary(const string& filename);
+    /// Save as a binary model
+    void write_binary(ostream& o) const;
+    /// Save in the text format of RandomForest::write
+    void write_text(ostream& o) const;
+    /// Method to predict the label
+    int predict(const InstanceSet& set, int instance_no) const;
+    /// Predict probability of given label
+    float predict_prob(const InstanceSet& set, int instance_no,
+                       int label) const;
+    /// Predict the labels and the probabilities of given label of
+    /// instances [begin, end) in one pass over the trees
+    void predict_batch(const InstanceSet& set, int begin, int end,
+                       int* labels, float* probs, int label = 0,
+                       int num_threads = 1) const;
+    /// Number of trees in the forest
+    int num_trees() const {
+      return num_trees_;
+    }
+    /// Number of (packed) split nodes
+    int num_split_nodes() const {
+      return num_split_nodes_;
+    }
+    /// Mean decrease in impurity per variable (see RandomForest)
+    vector<float> impurity_importance() const {
+      return vector<float>(importances_, importances_ + num_importances_);
+    }
+    static const uint32 kVersion;
+  private:
+    FlatForest();
+    // not copyable (the arrays may point into a mapping)
+    FlatForest(const FlatForest&);
+    FlatForest& operator=(const FlatForest&);
+    int add_tree(const Tree& tree);
+    void point_to_storage();
+    // Leaf label reached by each tree is added to votes
+    void vote(const InstanceSet& set, int instance_no,
+              unsigned int* votes) const;
+    // Votes of rows [begin, end), #labels per row, a tree at a time
+    void vote_block(const InstanceSet& set, int begin, int end,
+                    unsigned int* votes) const;
+    static void predict_block_task(int block, void* arg);
+    static const int kPredictBlock; // rows per block in batch prediction
+    // the arrays used for prediction
+    // (into the vectors below, or into a mapped file)
+    const int* roots_;
+    const uint32* attrs_;
+    const float* thresholds_;
+    const int* children_;
+    const float* importances_;
+    int num_importances_;
+    int num_trees_;
+    int num_split_nodes_;
+    int num_labels_;
+    int K_;
+    // storage of a forest packed in memory
+    vector<int> root_store_;
+    vector<uint32> attr_store_;
+    vector<float> threshold_store_;
+    vector<int> child_store_;
+    vector<float> importance_store_;
+    // mapped binary model (NULL if packed in memory)
+    void* map_;
+    size_t map_size_;
+};
+
+} // namespace
+#endif
@@ -4,26 +4,65 @@
 #include <iostream>
 #include <sstream>
 #include <float.h>
+#include <limits.h>
+#include <algorithm>
 #include "librf/weights.h"
 #include "librf/types.h"
 #include "librf/stringutils.h"
+#include "librf/parallel.h"
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 using namespace std;
 
 namespace librf {
-InstanceSet::InstanceSet(){}
+InstanceSet::InstanceSet() : sparse_(false), binned_(false), view_(false),
+                             map_(NULL), map_size_(0) {}
+
+InstanceSet::~InstanceSet() {
+  if (map_ != NULL) {
+    munmap(map_, map_size_);
+  }
+}
 /***
  * Named constructor for loading from a csv file and a label file
  * Makes simpler to have a separate label file.
  * @param csv_data CSV filename
  * @param header whether there is a header with var. names
  * @param delim CSV delimiter - defaults to ','
+ * @param num_threads #threads parsing the CSV (<= 0: all processors)
+ * @return NULL if the CSV file can't be read or is malformed
  */
 InstanceSet* InstanceSet::load_csv_and_labels(const string& csv_data,
                                       const string& label_file,
                                       bool header,
-                                      const string& delim) {
-  return new InstanceSet(csv_data, label_file, header, delim);
+                                      const string& delim,
+                                      int num_threads) {
+  InstanceSet* set = new InstanceSet();
+  if (!set->load_csv(csv_data, header, delim, num_threads)) {
+    delete set;
+    return NULL;
+  }
+  ifstream labels(label_file.c_str());
+  if (!set->load_labels(labels)) {
+    cerr << "Bad label in " << label_file << endl;
+    delete set;
+    return NULL;
+  }
+  if (set->attributes_.empty() ||
+      set->attributes_[0].size() != set->labels_.size()) {
+    cerr << label_file << " has " << set->labels_.size() << " labels for "
+         << (set->attributes_.empty() ? 0 : set->attributes_[0].size())
+         << " instances" << endl;
+    delete set;
+    return NULL;
+  }
+  set->create_sorted_indices(num_threads);
+  return set;
 }
 
 /***
@@ -31,12 +70,22 @@ InstanceSet* InstanceSet::load_csv_and_labels(const string& csv_data,
  * @param csv_data CSV filename
  * @param header whether there is a header with var. names
  * @param delim CSV delimiter - defaults to ','
+ * @param num_threads #threads parsing the CSV (<= 0: all processors)
+ * @return NULL if the CSV file can't be read or is malformed
  */
 InstanceSet* InstanceSet::load_unsupervised(const string& csv_data,
                                               unsigned int * seed,
                                       bool header,
-                                      const string& delim) {
-  return new InstanceSet(csv_data, seed, header, delim);
+                                      const string& delim,
+                                      int num_threads) {
+  InstanceSet* set = new InstanceSet();
+  if (!set->load_csv(csv_data, header, delim, num_threads)) {
+    delete set;
+    return NULL;
+  }
+  set->add_synthetic(seed);
+  set->create_sorted_indices(num_threads);
+  return set;
 }
 
 
@@ -53,28 +102,10 @@ InstanceSet* InstanceSet::create_subset(const InstanceSet& set,
   return new InstanceSet(set, wl);
 }
 /***
- * Unnamed private constructor for loading csv file/label file
+ * Label the loaded (organic) instances 0 and append as many synthetic
+ * ones, labelled 1, for unsupervised learning
  */
-InstanceSet::InstanceSet(const string& csv_data,
-            const string& label_file,
-            bool header, const string& delim) {
-  ifstream data(csv_data.c_str());
-  load_csv(data, header, delim);
-
-  ifstream labels(label_file.c_str());
-  load_labels(labels);
-  create_sorted_indices();
-  assert(attributes_.size() > 0);
-  assert(attributes_[0].size() == labels_.size());
-}
-
-/***
- * Unnamed private constructor for loading CSV for unsupervised
- */
-InstanceSet::InstanceSet(const string& csv_data, unsigned int* seed,
-                         bool header, const string& delim) {
-  ifstream data(csv_data.c_str());
-  load_csv(data, header, delim);
+void InstanceSet::add_synthetic(unsigned int* seed) {
   // organic set gets 0 label
   assert(attributes_.size() > 0);
   labels_.resize(attributes_[0].size(), 0);
@@ -90,7 +121,6 @@ InstanceSet::InstanceSet(const string& csv_data, unsigned int* seed,
     labels_.push_back(1);
   }
   assert(attributes_[0].size() == labels_.size());
-  create_sorted_indices();
 }
 
 /**
@@ -105,43 +135,223 @@ InstanceSet* InstanceSet::feature_select(const InstanceSet& set,
 
 /**
  * Private constructor for feature selection
+ * Only the column table is built: it points at the set's columns
  */
 InstanceSet::InstanceSet(const InstanceSet& set,
-                         const vector<int>& attrs) {
+                         const vector<int>& attrs) : sparse_(set.sparse_),
+                                                     binned_(set.binned_),
+                                                     view_(true),
+                                                     map_(NULL),
+                                                     map_size_(0) {
   // Copy labels
   labels_ = set.labels_;
-  // Only copy given attrs
-  attributes_.resize(attrs.size());
-  sorted_indices_.resize(attrs.size());
+  weights_ = set.weights_;
+  distribution_ = set.distribution_;
   var_names_.resize(attrs.size());
+  columns_.resize(attrs.size());
   for (int i = 0; i < attrs.size(); ++i) {
-    attributes_[i] = set.attributes_[attrs[i]];
-    sorted_indices_[i] = set.sorted_indices_[attrs[i]];
     var_names_[i] = set.var_names_[attrs[i]];
+    columns_[i] = set.columns_[attrs[i]];
   }
 }
+
+/**
+ * Point the column table at this set's own storage
+ * (after the storage has been filled or reallocated). Columns without
+ * storage of their own keep pointing into the mapped file (load_binary)
+ */
+void InstanceSet::point_to_storage() {
+  int num_attributes = sparse_ ? sparse_instances_.size()
+                               : attributes_.size();
+  binned_ = !bins_.empty();
+  columns_.resize(num_attributes);
+  for (int i = 0; i < num_attributes; ++i) {
+    attribute_column& column = columns_[i];
+    if (sparse_) {
+      column.nonzero_instances = &sparse_instances_[i];
+      column.nonzero_values = &sparse_values_[i];
+      continue;
+    }
+    if (!attributes_[i].empty()) {
+      column.values = &attributes_[i][0];
+    }
+    if (i < sorted_indices_.size() && !sorted_indices_[i].empty()) {
+      column.sorted = &sorted_indices_[i][0];
+    }
+    if (binned_) {
+      if (!bins_[i].empty()) {
+        column.bins = &bins_[i][0];
+      }
+      column.cuts = &bin_cuts_[i];
+    }
+  }
+}
+
 /***
  * Load labels from an istream
+ * @return false at the first label that is not +1, 0 or -1
  *
  * LIMITATION: assumes binary labels... this needs to change
  */
-void InstanceSet::load_labels(istream&in) {
+bool InstanceSet::load_labels(istream&in) {
   float label;
-  int true_label;
   while (in >> label) {
-    if (label == -1.0) {
-      true_label =0;
-    } else if (label ==0.0) {
-      true_label =0;
-    } else if (label ==1.0) {
-      true_label =1;
-    } else {
-      cerr << "Incorrect label (only +1, 0, -1 supported)" << endl;
-      assert(false);
+    int label_no = true_label(label);
+    if (label_no < 0) {
+      return false;
+    }
+    labels_.push_back(label_no);
+    distribution_.add(label_no);
+  }
+  return true;
+}
+
+void InstanceSet::set_weights(const vector<float>& weights) {
+  assert(weights.size() == size());
+  weights_ = weights;
+}
+
+bool InstanceSet::load_weights(const string& filename) {
+  ifstream in(filename.c_str());
+  vector<float> weights;
+  float weight;
+  while (in >> weight) {
+    if (weight < 0) {
+      cerr << "Negative sample weight in " << filename << endl;
+      return false;
     }
-    labels_.push_back(true_label);
-    distribution_.add(true_label);
+    weights.push_back(weight);
   }
+  if (weights.size() != size()) {
+    cerr << filename << " has " << weights.size() << " weights for "
+         << size() << " instances" << endl;
+    return false;
+  }
+  weights_ = weights;
+  return true;
+}
+
+// Map a label as written in a file (+1, 0, -1) to a label number
+// (-1 for any other label)
+int InstanceSet::true_label(float label) {
+  int true_label = -1;
+  if (label == -1.0) {
+    true_label =0;
+  } else if (label ==0.0) {
+    true_label =0;
+  } else if (label ==1.0) {
+    true_label =1;
+  } else {
+    cerr << "Incorrect label " << label << " (only +1, 0, -1 supported)"
+         << endl;
+  }
+  return true_label;
+}
+
+/**
+ * Named constructor for loading a libsvm file
+ * (label index:value index:value ..., indices start at 1)
+ * The attributes are stored sparsely
+ * @param filename libsvm filename
+ * @param num_features #attributes (-1: the largest index in the file)
+ * @return NULL if the file has no instances, a bad label or a feature
+ * index < 1
+ */
+InstanceSet* InstanceSet::load_libsvm(const string& filename,
+                                      int num_features) {
+  InstanceSet* set = new InstanceSet();
+  set->sparse_ = true;
+  ifstream in(filename.c_str());
+  int line = set->load_svm(in);
+  if (line > 0) {
+    cerr << filename << ":" << line << ": bad label or feature index"
+         << endl;
+    delete set;
+    return NULL;
+  }
+  if (set->labels_.empty()) {
+    cerr << filename << " has no instances" << endl;
+    delete set;
+    return NULL;
+  }
+  if (num_features > int(set->sparse_instances_.size())) {
+    set->sparse_instances_.resize(num_features);
+    set->sparse_values_.resize(num_features);
+  }
+  set->create_dummy_var_names(set->sparse_instances_.size());
+  set->point_to_storage();
+  return set;
+}
+
+/***
+ * Load libsvm lines from an istream
+ * Instances arrive in order, so every column is built up sorted
+ * by instance number
+ * @return the (1-based) line of the first bad label or feature index,
+ * 0 if there is none
+ */
+int InstanceSet::load_svm(istream& in) {
+  string buffer;
+  int line = 0;
+  while (getline(in, buffer)) {
+    ++line;
+    const char* p = buffer.c_str();
+    char* end;
+    float label = strtof(p, &end);
+    if (end == p) {
+      // blank line
+      continue;
+    }
+    uint32 instance = labels_.size();
+    int label_no = true_label(label);
+    if (label_no < 0) {
+      return line;
+    }
+    labels_.push_back(label_no);
+    distribution_.add(label_no);
+    p = end;
+    while (true) {
+      long index = strtol(p, &end, 10);
+      if (end == p || *end != ':') {
+        break;
+      }
+      if (index < 1 || index > INT_MAX) {
+        return line;
+      }
+      float value = strtof(end + 1, &end);
+      p = end;
+      if (value == 0) {
+        continue;
+      }
+      int attr = index - 1;
+      if (attr >= sparse_instances_.size()) {
+        sparse_instances_.resize(attr + 1);
+        sparse_values_.resize(attr + 1);
+      }
+      // indices within a line are expected to be ascending, but the
+      // columns only need the instances to be
+      sparse_instances_[attr].push_back(instance);
+      sparse_values_[attr].push_back(value);
+    }
+  }
+  return 0;
+}
+
+/**
+ * Value of a sparsely stored attribute (0 unless it is stored)
+ */
+float InstanceSet::sparse_attribute(int i, int attr) const {
+  if (attr >= columns_.size()) {
+    return 0;
+  }
+  const vector<uint32>& instances = *columns_[attr].nonzero_instances;
+  vector<uint32>::const_iterator it = lower_bound(instances.begin(),
+                                                  instances.end(),
+                                                  uint32(i));
+  if (it == instances.end() || *it != i) {
+    return 0;
+  }
+  return (*columns_[attr].nonzero_values)[it - instances.begin()];
 }
 
 /**
@@ -155,65 +365,595 @@ void InstanceSet::write_csv(ostream& out, bool header,
     }
     out << var_names_[num_attributes() - 1] << endl;
   }
-  assert(attributes_.size() > 0);
-  assert(attributes_[0].size() > 0);
-  for (int i = 0; i < attributes_[0].size(); ++i) {
+  assert(num_attributes() > 0);
+  assert(size() > 0);
+  for (int i = 0; i < size(); ++i) {
     for (int j = 0; j < num_attributes() - 1; ++j) {
-      out << attributes_[j][i] << delim;
+      out << get_attribute(i, j) << delim;
     }
-    out << attributes_[num_attributes() - 1][i] << endl;
+    out << get_attribute(i, num_attributes() - 1) << endl;
   }
 }
 
 void InstanceSet::write_transposed_csv(ostream& out,
                             const string& delim) {
-  assert(attributes_.size() > 0);
-  assert(attributes_[0].size() > 0);
+  assert(num_attributes() > 0);
+  assert(size() > 0);
   for (int j = 0; j < num_attributes(); ++j) {
-    for (int i = 0; i < attributes_[0].size() - 1; ++i) {
-      out << attributes_[j][i] << delim;
+    for (int i = 0; i < size() - 1; ++i) {
+      out << get_attribute(i, j) << delim;
     }
-    out << attributes_[j][attributes_[0].size() - 1] << endl;
+    out << get_attribute(size() - 1, j) << endl;
   }
 }
 
 
 
 
+// Header of a binary data file (see write_binary)
+struct instance_set_header {
+  char magic[4];          // "LRFD"
+  uint32 version;
+  uint32 num_instances;
+  uint32 num_attributes;
+  uint32 flags;           // kSparseData | kSortedData
+};
+
+static const char kDataMagic[4] = {'L', 'R', 'F', 'D'};
+// version 1 files have no weights or bins
+static const uint32 kDataVersion = 2;
+static const uint32 kSparseData = 1;
+static const uint32 kSortedData = 2;
+static const uint32 kWeightedData = 4;
+static const uint32 kBinnedData = 8;
+
+// sections of a binary data file start 4 byte aligned
+static size_t padded(size_t bytes) {
+  return (bytes + 3) / 4 * 4;
+}
+
+static void write_section(ostream& out, const void* data, size_t bytes) {
+  static const char zeros[4] = {0, 0, 0, 0};
+  out.write(static_cast<const char*>(data), bytes);
+  out.write(zeros, padded(bytes) - bytes);
+}
+
+// Next section of a mapped file (NULL if the file is too short)
+static const char* next_section(const char** p, const char* end,
+                                size_t bytes) {
+  const char* section = *p;
+  if (section > end || size_t(end - section) < bytes) {
+    return NULL;
+  }
+  *p = section + padded(bytes);
+  return section;
+}
+
+/**
+ * Save the set in a binary, column oriented file:
+ *  - header (instance_set_header)
+ *  - labels (uchar)
+ *  - var names (uint32 #bytes, then the names, NUL terminated)
+ *  - sample weights (float) if they have been set
+ *  - dense sets: the columns (float), then the sorted indices (uint32)
+ *    if they have been created, then if binned: #cuts of every
+ *    attribute (uint32), and the cuts (float) and bins (uchar) of each
+ *    attribute
+ *  - sparse sets: #nonzeros of every attribute (uint32), then the
+ *    instances (uint32) and values (float) of each attribute
+ * Every section is 4 byte aligned. Byte order is the host's.
+ */
+void InstanceSet::write_binary(ostream& out) const {
+  uint32 n = size();
+  uint32 p = num_attributes();
+  bool sorted = !sparse_ && p > 0 && columns_[0].sorted != NULL;
+  instance_set_header header;
+  memcpy(header.magic, kDataMagic, sizeof(kDataMagic));
+  header.version = kDataVersion;
+  header.num_instances = n;
+  header.num_attributes = p;
+  header.flags = (sparse_ ? kSparseData : 0) | (sorted ? kSortedData : 0) |
+                 (weighted() ? kWeightedData : 0) |
+                 (binned_ ? kBinnedData : 0);
+  write_section(out, &header, sizeof(header));
+  write_section(out, n > 0 ? &labels_[0] : NULL, n);
+  string names;
+  for (int i = 0; i < p; ++i) {
+    names += var_names_[i];
+    names += '\0';
+  }
+  uint32 names_size = names.size();
+  write_section(out, &names_size, sizeof(names_size));
+  write_section(out, names.data(), names_size);
+  if (weighted()) {
+    write_section(out, &weights_[0], n * sizeof(float));
+  }
+  if (sparse_) {
+    vector<uint32> nonzeros(p);
+    for (int i = 0; i < p; ++i) {
+      nonzeros[i] = columns_[i].nonzero_instances->size();
+    }
+    write_section(out, p > 0 ? &nonzeros[0] : NULL, p * sizeof(uint32));
+    for (int i = 0; i < p; ++i) {
+      if (nonzeros[i] > 0) {
+        write_section(out, &(*columns_[i].nonzero_instances)[0],
+                      nonzeros[i] * sizeof(uint32));
+        write_section(out, &(*columns_[i].nonzero_values)[0],
+                      nonzeros[i] * sizeof(float));
+      }
+    }
+    return;
+  }
+  for (int i = 0; i < p && n > 0; ++i) {
+    write_section(out, columns_[i].values, n * sizeof(float));
+  }
+  for (int i = 0; i < p && n > 0 && sorted; ++i) {
+    write_section(out, columns_[i].sorted, n * sizeof(int));
+  }
+  if (binned_) {
+    vector<uint32> num_cuts(p);
+    for (int i = 0; i < p; ++i) {
+      num_cuts[i] = columns_[i].cuts->size();
+    }
+    write_section(out, p > 0 ? &num_cuts[0] : NULL, p * sizeof(uint32));
+    for (int i = 0; i < p; ++i) {
+      write_section(out, num_cuts[i] > 0 ? &(*columns_[i].cuts)[0] : NULL,
+                    num_cuts[i] * sizeof(float));
+      write_section(out, columns_[i].bins, n);
+    }
+  }
+}
+
+bool InstanceSet::is_binary(const string& filename) {
+  ifstream in(filename.c_str(), ios::binary);
+  char magic[4];
+  in.read(magic, sizeof(magic));
+  return in.good() && memcmp(magic, kDataMagic, sizeof(kDataMagic)) == 0;
+}
+
+/**
+ * Named constructor for loading a set saved by write_binary
+ * The file is mapped, and the column table of a dense set points
+ * straight into it: the columns, sorted indices and bins are neither
+ * copied nor parsed, and the mapping lives as long as the set. Only
+ * the labels, names, weights and bin cuts (and the columns of a sparse
+ * set) are copied out. The sorted indices are checked, as the tree
+ * builder trusts them; nothing is sorted unless the file has none.
+ */
+InstanceSet* InstanceSet::load_binary(const string& filename) {
+  int fd = open(filename.c_str(), O_RDONLY);
+  if (fd < 0) {
+    cerr << "Could not open " << filename << endl;
+    return NULL;
+  }
+  struct stat st;
+  if (fstat(fd, &st) != 0) {
+    cerr << "Could not read " << filename << endl;
+    close(fd);
+    return NULL;
+  }
+  size_t size = st.st_size;
+  void* map = (size > 0) ? mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0)
+                         : MAP_FAILED;
+  close(fd);
+  if (map == MAP_FAILED) {
+    cerr << filename << " is not a binary data file" << endl;
+    return NULL;
+  }
+  const char* p = static_cast<const char*>(map);
+  const char* end = p + size;
+  const instance_set_header* header =
+      reinterpret_cast<const instance_set_header*>(
+          next_section(&p, end, sizeof(instance_set_header)));
+  if (header == NULL || memcmp(header->magic, kDataMagic,
+                               sizeof(kDataMagic)) != 0 ||
+      header->version < 1 || header->version > kDataVersion) {
+    cerr << filename << " is not a version " << kDataVersion
+         << " binary data file" << endl;
+    munmap(map, size);
+    return NULL;
+  }
+  uint32 n = header->num_instances;
+  uint32 num_attributes = header->num_attributes;
+  InstanceSet* set = new InstanceSet();
+  set->sparse_ = (header->flags & kSparseData) != 0;
+  // (released with the set)
+  set->map_ = map;
+  set->map_size_ = size;
+  bool valid = true;
+  const uchar* labels = reinterpret_cast<const uchar*>(
+                                            next_section(&p, end, n));
+  const uint32* names_size = reinterpret_cast<const uint32*>(
+                                next_section(&p, end, sizeof(uint32)));
+  const char* names = (names_size == NULL) ? NULL :
+                                next_section(&p, end, *names_size);
+  if (labels == NULL || names == NULL) {
+    valid = false;
+  } else {
+    set->labels_.assign(labels, labels + n);
+    for (int i = 0; i < n; ++i) {
+      set->distribution_.add(labels[i]);
+    }
+    const char* name = names;
+    while (name < names + *names_size) {
+      set->var_names_.push_back(string(name));
+      name += set->var_names_.back().size() + 1;
+    }
+  }
+  if (valid && (header->flags & kWeightedData)) {
+    const float* weights = reinterpret_cast<const float*>(
+                             next_section(&p, end, n * sizeof(float)));
+    valid = (weights != NULL);
+    if (valid) {
+      set->weights_.assign(weights, weights + n);
+    }
+  }
+  if (valid && set->sparse_) {
+    const uint32* nonzeros = reinterpret_cast<const uint32*>(
+                   next_section(&p, end, num_attributes * sizeof(uint32)));
+    valid = (nonzeros != NULL);
+    if (valid) {
+      set->sparse_instances_.resize(num_attributes);
+      set->sparse_values_.resize(num_attributes);
+    }
+    for (int i = 0; valid && i < num_attributes; ++i) {
+      if (nonzeros[i] == 0) {
+        continue;
+      }
+      const uint32* instances = reinterpret_cast<const uint32*>(
+                   next_section(&p, end, nonzeros[i] * sizeof(uint32)));
+      const float* values = reinterpret_cast<const float*>(
+                   next_section(&p, end, nonzeros[i] * sizeof(float)));
+      valid = (instances != NULL && values != NULL);
+      for (uint32 k = 0; valid && k < nonzeros[i]; ++k) {
+        valid = (instances[k] < n);
+      }
+      if (valid) {
+        set->sparse_instances_[i].assign(instances, instances + nonzeros[i]);
+        set->sparse_values_[i].assign(values, values + nonzeros[i]);
+      }
+    }
+  } else if (valid) {
+    // no storage of their own: point_to_storage keeps the columns
+    // pointing into the mapping
+    set->attributes_.resize(num_attributes);
+    set->columns_.resize(num_attributes);
+    for (int i = 0; valid && i < num_attributes; ++i) {
+      const float* column = reinterpret_cast<const float*>(
+                             next_section(&p, end, n * sizeof(float)));
+      valid = (column != NULL);
+      if (valid) {
+        set->columns_[i].values = column;
+      }
+    }
+    if (valid && (header->flags & kSortedData)) {
+      for (int i = 0; valid && i < num_attributes; ++i) {
+        const int* sorted = reinterpret_cast<const int*>(
+                             next_section(&p, end, n * sizeof(int)));
+        valid = (sorted != NULL);
+        for (uint32 k = 0; valid && k < n; ++k) {
+          valid = (sorted[k] >= 0 && uint32(sorted[k]) < n);
+        }
+        if (valid) {
+          set->columns_[i].sorted = sorted;
+        }
+      }
+    } else if (valid) {
+      set->create_sorted_indices();
+    }
+    if (valid && (header->flags & kBinnedData)) {
+      const uint32* num_cuts = reinterpret_cast<const uint32*>(
+                   next_section(&p, end, num_attributes * sizeof(uint32)));
+      valid = (num_cuts != NULL);
+      if (valid) {
+        set->bins_.resize(num_attributes);
+        set->bin_cuts_.resize(num_attributes);
+      }
+      for (int i = 0; valid && i < num_attributes; ++i) {
+        valid = (num_cuts[i] < 256);
+        const float* cuts = !valid ? NULL : reinterpret_cast<const float*>(
+                   next_section(&p, end, num_cuts[i] * sizeof(float)));
+        const uchar* bins = reinterpret_cast<const uchar*>(
+                   next_section(&p, end, n));
+        valid = (cuts != NULL && bins != NULL);
+        if (valid) {
+          set->bin_cuts_[i].assign(cuts, cuts + num_cuts[i]);
+          set->columns_[i].bins = bins;
+        }
+      }
+    }
+  }
+  if (set->sparse_) {
+    // everything was copied
+    munmap(map, size);
+    set->map_ = NULL;
+  }
+  if (!valid) {
+    cerr << filename << " is truncated or corrupt" << endl;
+    delete set;
+    return NULL;
+  }
+  set->point_to_storage();
+  return set;
+}
+
+// A run of whole lines of a mapped CSV file, parsed by one worker
+struct csv_chunk {
+  const char* begin;
+  const char* end;
+  int first_row;
+  int num_rows;
+  int num_lines;  // (blank ones included)
+  int bad_line;   // first line of the chunk with the wrong #fields, or -1
+};
+
+// Shared state of the CSV loading workers
+struct csv_context {
+  vector< vector<float> >* attributes;
+  vector<csv_chunk> chunks;
+  bool is_delim[256];
+  int num_features;
+};
+
+static const float kPowersOf10[] = {1e0f, 1e1f, 1e2f, 1e3f, 1e4f, 1e5f,
+                                    1e6f, 1e7f};
+
+/**
+ * Parse the number at p, stopping at the first character that is not
+ * part of it (like strtof).
+ * Plain decimals of up to 7 digits are exact in float arithmetic, so
+ * they are converted directly (one correctly rounded division gives
+ * the same result as strtof); anything else goes to strtof.
+ */
+static float parse_float(const char* p, const char** end) {
+  const char* s = p;
+  bool negative = (*s == '-');
+  if (*s == '-' || *s == '+') {
+    ++s;
+  }
+  uint32 mantissa = 0;
+  int digits = 0;
+  int decimals = 0;
+  while (*s >= '0' && *s <= '9' && digits <= 7) {
+    mantissa = mantissa * 10 + (*s - '0');
+    ++digits;
+    ++s;
+  }
+  if (*s == '.') {
+    ++s;
+    while (*s >= '0' && *s <= '9' && digits <= 7) {
+      mantissa = mantissa * 10 + (*s - '0');
+      ++digits;
+      ++decimals;
+      ++s;
+    }
+  }
+  if (digits == 0 || digits > 7 || *s == 'e' || *s == 'E' || *s == 'x' || *s == 'X') {
+    char* e;
+    float val = strtof(p, &e);
+    *end = e;
+    return val;
+  }
+  *end = s;
+  float val = float(mantissa) / kPowersOf10[decimals];
+  return negative ? -val : val;
+}
+
+// Lines of [begin, end) that hold data (blank lines are skipped)
+static int count_rows(const char* begin, const char* end, int* num_lines) {
+  int rows = 0;
+  *num_lines = 0;
+  const char* line = begin;
+  while (line < end) {
+    const char* eol = static_cast<const char*>(memchr(line, '\n',
+                                                      end - line));
+    if (eol == NULL) {
+      eol = end;
+    }
+    if (eol > line && !(eol == line + 1 && *line == '\r')) {
+      rows++;
+    }
+    ++*num_lines;
+    line = eol + 1;
+  }
+  return rows;
+}
+
+static void count_csv_task(int chunk, void* arg) {
+  csv_context* context = static_cast<csv_context*>(arg);
+  csv_chunk& c = context->chunks[chunk];
+  c.num_rows = count_rows(c.begin, c.end, &c.num_lines);
+}
+
+/**
+ * Parse the lines of a chunk into their rows
+ * Every line must have num_features fields: the chunk stops at the
+ * first one that doesn't (bad_line), before its row could run past
+ * the rows counted for the chunk or into the next line.
+ * Empty fields are 0
+ */
+static void parse_csv_task(int chunk, void* arg) {
+  csv_context* context = static_cast<csv_context*>(arg);
+  csv_chunk& c = context->chunks[chunk];
+  vector< vector<float> >& attributes = *context->attributes;
+  const bool* is_delim = context->is_delim;
+  int row = c.first_row;
+  int line = 0;
+  const char* p = c.begin;
+  c.bad_line = -1;
+  while (p < c.end) {
+    if (*p == '\n' || (*p == '\r' && p[1] == '\n')) {
+      // blank line
+      p += (*p == '\r') ? 2 : 1;
+      ++line;
+      continue;
+    }
+    for (int i = 0; i < context->num_features; ++i) {
+      // leading blanks are skipped here: strtof would skip a line end
+      // too, and read an empty field from the next line
+      while (p < c.end && (*p == ' ' || *p == '\t') &&
+             !is_delim[uchar(*p)]) {
+        ++p;
+      }
+      if (p == c.end || is_delim[uchar(*p)] || *p == '\r' || *p == '\n') {
+        // empty field
+        attributes[i][row] = 0;
+      } else {
+        attributes[i][row] = parse_float(p, &p);
+      }
+      // skip whatever is left of the field
+      while (p < c.end && !is_delim[uchar(*p)] && *p != '\n') {
+        ++p;
+      }
+      if (i < context->num_features - 1) {
+        if (p == c.end || !is_delim[uchar(*p)]) {
+          // too few fields
+          c.bad_line = line;
+          return;
+        }
+        ++p;
+      }
+    }
+    if (p < c.end && *p != '\n') {
+      // too many fields
+      c.bad_line = line;
+      return;
+    }
+    ++p;
+    ++row;
+    ++line;
+  }
+  assert(row == c.first_row + c.num_rows);
+}
+
 /***
- * Load csv from an istream
+ * Load a csv file
+ * The file is mapped and tokenized in place. The lines are counted
+ * first, so every column is allocated once, then chunks of lines are
+ * parsed by num_threads workers (<= 0 means one per processor).
  */
-void InstanceSet::load_csv(istream&in, bool header, const string& delim) {
+bool InstanceSet::load_csv(const string& filename, bool header,
+                           const string& delim, int num_threads) {
+  int fd = open(filename.c_str(), O_RDONLY);
+  if (fd < 0) {
+    cerr << "Can't open " << filename << endl;
+    return false;
+  }
+  struct stat st;
+  if (fstat(fd, &st) != 0) {
+    cerr << "Can't read " << filename << endl;
+    close(fd);
+    return false;
+  }
+  size_t size = st.st_size;
+  if (size == 0) {
+    close(fd);
+    return true;
+  }
+  void* map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (map == MAP_FAILED) {
+    cerr << "Can't map " << filename << endl;
+    return false;
+  }
+  madvise(map, size, MADV_SEQUENTIAL);
+  const char* data = static_cast<const char*>(map);
+  const char* data_end = data + size;
   // read variable names
   int num_features = -1;
-  string buffer;
-  getline(in, buffer);
+  const char* eol = static_cast<const char*>(memchr(data, '\n', size));
+  if (eol == NULL) {
+    eol = data_end;
+  }
+  string buffer(data, eol);
+  if (!buffer.empty() && buffer[buffer.size() - 1] == '\r') {
+    buffer.erase(buffer.size() - 1);
+  }
   if (header) {
     StringUtils::split(buffer, &var_names_, delim);
     num_features = var_names_.size();
+    data = (eol == data_end) ? data_end : eol + 1;
   } else {
     vector<string> ary;
     StringUtils::split(buffer, &ary, delim);
     num_features = ary.size();
-    // reset istream
-    in.seekg (0, ios::beg);
     // create dummy var names
   }
   create_dummy_var_names(num_features);
   attributes_.resize(num_features);
-  // get all data
-  while(getline(in, buffer)) {
-    vector<string> ary;
-    StringUtils::split(buffer, &ary, delim);
-    assert(ary.size() == num_features);
-    for (int i = 0; i < ary.size(); ++i) {
-      stringstream ss(ary[i]);
-      //convert to float
-      float val;
-      ss >> val;
-      attributes_[i].push_back(val);
+
+  // strtof needs to stop inside the mapping: if the last line is not
+  // terminated, it is parsed from a copy instead
+  string last_line;
+  if (data < data_end && data_end[-1] != '\n') {
+    const char* last = data_end;
+    while (last > data && last[-1] != '\n') {
+      --last;
+    }
+    last_line.assign(last, data_end);
+    last_line += '\n';
+    data_end = last;
+  }
+
+  csv_context context;
+  context.attributes = &attributes_;
+  context.num_features = num_features;
+  for (int i = 0; i < 256; ++i) {
+    context.is_delim[i] = false;
+  }
+  for (int i = 0; i < delim.size(); ++i) {
+    context.is_delim[uchar(delim[i])] = true;
+  }
+  // cut the data into chunks of whole lines
+  if (num_threads <= 0) {
+    num_threads = num_processors();
+  }
+  int num_chunks = (num_threads == 1) ? 1 : 4 * num_threads;
+  size_t chunk_size = (data_end - data) / num_chunks + 1;
+  const char* begin = data;
+  while (begin < data_end) {
+    const char* end = begin + chunk_size;
+    if (end >= data_end) {
+      end = data_end;
+    } else {
+      end = static_cast<const char*>(memchr(end, '\n', data_end - end));
+      end = (end == NULL) ? data_end : end + 1;
     }
+    csv_chunk c = {begin, end, 0, 0, 0, -1};
+    context.chunks.push_back(c);
+    begin = end;
+  }
+  if (!last_line.empty()) {
+    const char* line = last_line.c_str();
+    csv_chunk c = {line, line + last_line.size(), 0, 0, 0, -1};
+    context.chunks.push_back(c);
   }
+  int chunks = context.chunks.size();
+  parallel_for(chunks, num_threads, count_csv_task, &context);
+  int num_rows = 0;
+  for (int i = 0; i < chunks; ++i) {
+    context.chunks[i].first_row = num_rows;
+    num_rows += context.chunks[i].num_rows;
+  }
+  for (int i = 0; i < num_features; ++i) {
+    attributes_[i].resize(num_rows);
+  }
+  parallel_for(chunks, num_threads, parse_csv_task, &context);
+  munmap(map, size);
+  // report the first malformed line (1-based, counting the header)
+  int line = header ? 1 : 0;
+  for (int i = 0; i < chunks; ++i) {
+    const csv_chunk& c = context.chunks[i];
+    if (c.bad_line >= 0) {
+      cerr << filename << ":" << line + c.bad_line + 1 << ": expected "
+           << num_features << " fields" << endl;
+      attributes_.clear();
+      var_names_.clear();
+      return false;
+    }
+    line += c.num_lines;
+  }
+  return true;
 }
 
 void InstanceSet::create_dummy_var_names(int n) {
@@ -223,42 +963,163 @@ void InstanceSet::create_dummy_var_names(int n) {
     var_names_.push_back(ss.str());
   }
 }
-void InstanceSet::create_sorted_indices() {
-    // allocate sorted_indices_
-    sorted_indices_.resize(attributes_.size());
-    // sort 
-    for (int i = 0; i < attributes_.size(); ++i) {
-        sort_attribute(attributes_[i], &sorted_indices_[i]);
-    }
+/**
+ * Sort every attribute (in parallel, one attribute per task)
+ * @param num_threads #threads (<= 0: all processors)
+ */
+void InstanceSet::create_sorted_indices(int num_threads) {
+  assert(!view_);
+  point_to_storage();
+  sorted_indices_.resize(attributes_.size());
+  parallel_for(attributes_.size(), num_threads, sort_attribute_task, this);
+  point_to_storage();
 }
 
-void InstanceSet::sort_attribute(const vector<float>& attribute,
-                                 vector<int>*indices) {
-    vector<pair<float, int> > pairs;
-    for (int i = 0; i < attribute.size(); ++i) {
-        pairs.push_back(make_pair(attribute[i],i));
+void InstanceSet::sort_attribute_task(int attr, void* arg) {
+  InstanceSet* set = static_cast<InstanceSet*>(arg);
+  sort_attribute(set->columns_[attr].values, set->size(),
+                 &set->sorted_indices_[attr]);
+}
+
+// Radix sort digits: 3 passes of 11 bits cover a 32 bit key
+static const int kRadixBits = 11;
+static const int kRadixPasses = 3;
+static const uint32 kRadixMask = (1 << kRadixBits) - 1;
+
+// Radix sort key of a float: setting the sign bit of positive values and
+// flipping every bit of negative ones makes unsigned order float order
+static inline uint32 float_key(float value) {
+  uint32 bits;
+  memcpy(&bits, &value, sizeof(bits));
+  // -0 ties with +0 (as with operator<)
+  if (bits == 0x80000000u) {
+    bits = 0;
+  }
+  return (bits & 0x80000000u) ? ~bits : (bits | 0x80000000u);
+}
+
+/**
+ * Instance numbers in increasing order of value, ties in instance order
+ * (LSD radix sort, which is stable; digits every key shares are skipped)
+ */
+void InstanceSet::sort_attribute(const float* attribute, int n,
+                                 vector<int>* indices) {
+  indices->resize(n);
+  if (n == 0) {
+    return;
+  }
+  vector<uint32> key_store(2 * n);
+  vector<int> index_store(n);
+  uint32* keys = &key_store[0];
+  uint32* keys_out = keys + n;
+  int* index = &(*indices)[0];
+  int* index_out = &index_store[0];
+  uint32 counts[kRadixPasses][kRadixMask + 1];
+  memset(counts, 0, sizeof(counts));
+  for (int i = 0; i < n; ++i) {
+    keys[i] = float_key(attribute[i]);
+    index[i] = i;
+    for (int pass = 0; pass < kRadixPasses; ++pass) {
+      counts[pass][(keys[i] >> (pass * kRadixBits)) & kRadixMask]++;
     }
-    sort(pairs.begin(), pairs.end());
-    for (int i = 0; i < pairs.size(); ++i) {
-        indices->push_back(pairs[i].second);
+  }
+  for (int pass = 0; pass < kRadixPasses; ++pass) {
+    int shift = pass * kRadixBits;
+    uint32* count = counts[pass];
+    if (count[(keys[0] >> shift) & kRadixMask] == n) {
+      continue;
+    }
+    // counts -> first position of every digit
+    uint32 position = 0;
+    for (int d = 0; d <= kRadixMask; ++d) {
+      uint32 c = count[d];
+      count[d] = position;
+      position += c;
+    }
+    for (int i = 0; i < n; ++i) {
+      uint32 pos = count[(keys[i] >> shift) & kRadixMask]++;
+      keys_out[pos] = keys[i];
+      index_out[pos] = index[i];
+    }
+    swap(keys, keys_out);
+    swap(index, index_out);
+  }
+  if (index != &(*indices)[0]) {
+    memcpy(&(*indices)[0], index, n * sizeof(int));
+  }
+}
+
+/**
+ * Quantize every attribute into at most max_bins bins.
+ * The bins are (roughly) equal frequency, and are computed
+ * from the sorted indices, so create_sorted_indices must come first.
+ * @param max_bins maximum number of bins per attribute (<= 256)
+ */
+void InstanceSet::create_bins(int max_bins) {
+  assert(max_bins > 1 && max_bins <= 256);
+  // sparse sets are not binned (their split search only sorts nonzeros),
+  // views share the bins of their set
+  assert(!sparse_ && !view_);
+  assert(attributes_.empty() || columns_[0].sorted != NULL);
+  bins_.resize(attributes_.size());
+  bin_cuts_.resize(attributes_.size());
+  for (int i = 0; i < attributes_.size(); ++i) {
+    bin_attribute(i, max_bins);
+  }
+  point_to_storage();
+}
+
+void InstanceSet::bin_attribute(int attr, int max_bins) {
+  const float* attribute = columns_[attr].values;
+  const int* sorted = columns_[attr].sorted;
+  const int n = size();
+  vector<float>& cuts = bin_cuts_[attr];
+  cuts.clear();
+  // Walk the sorted values, closing a bin once it is big enough
+  // (a bin can only end between two distinct values)
+  float bin_size = float(n) / max_bins;
+  int in_bin = 0;
+  for (int i = 0; i + 1 < n; ++i) {
+    in_bin++;
+    float cur = attribute[sorted[i]];
+    float next = attribute[sorted[i + 1]];
+    if (cur < next && in_bin >= bin_size && cuts.size() < max_bins - 1) {
+      // same split point as the presorted tree would choose
+      cuts.push_back((cur + next) / 2.0);
+      in_bin = 0;
     }
+  }
+  // bin = number of cuts <= value, so value < cuts[b] <=> bin <= b
+  vector<uchar>& bins = bins_[attr];
+  bins.resize(n);
+  for (int i = 0; i < n; ++i) {
+    bins[i] = upper_bound(cuts.begin(), cuts.end(), attribute[i])
+              - cuts.begin();
+  }
 }
 
 // Grab a subset of the instance (for getting OOB data
+// (stored densely, even if the set is sparse)
 InstanceSet::InstanceSet(const InstanceSet& set,
-                         const weight_list& weights) : attributes_(set.num_attributes()){
+                         const weight_list& weights) :
+                                     attributes_(set.num_attributes()),
+                                     sparse_(false),
+                                     binned_(false), view_(false),
+                                     map_(NULL), map_size_(0) {
   // Calculate the number of OOB cases
   //cout << "creating OOB subset for weight list of size "
   //     << weights.size() << endl;
-  for (int i = 0; i < weights.size(); ++i) {
-    if (weights[i] == 0) {
-      // append instance
-      for (int j = 0; j < set.num_attributes(); ++j) {
-          attributes_[j].push_back(set.get_attribute(i, j));
-      }
-      labels_.push_back(set.label(i));
+  vector<int> oob;
+  weights.zeros(&oob);
+  for (int k = 0; k < oob.size(); ++k) {
+    int i = oob[k];
+    // append instance
+    for (int j = 0; j < set.num_attributes(); ++j) {
+        attributes_[j].push_back(set.get_attribute(i, j));
     }
+    labels_.push_back(set.label(i));
   }
+  point_to_storage();
 }
 
 
@@ -267,7 +1128,13 @@ InstanceSet::InstanceSet(const InstanceSet& set,
  * Used for variable importance
  */
 void InstanceSet::permute(int var, unsigned int *seed) {
+  assert(!sparse_ && !view_);
   vector<float>& attr = attributes_[var];
+  if (attr.empty() && size() > 0) {
+    // served from a mapped file: permute a copy
+    save_var(var, &attr);
+    point_to_storage();
+  }
   for (int i = 0; i < attr.size(); ++i) {
     int idx = rand_r(seed) % labels_.size(); // randomly select an index
     float tmp = attr[i];  // swap last value with random index value
@@ -277,14 +1144,36 @@ void InstanceSet::permute(int var, unsigned int *seed) {
 }
 
 void InstanceSet::load_var(int var, const vector<float>& source) {
+  assert(!sparse_ && !view_);
   // use the STL built-in copy/assignment
   attributes_[var] = source;
+  point_to_storage();
 }
 
 void InstanceSet::save_var(int var, vector<float>* target) {
-  const vector<float>& attr = attributes_[var];
-  // use the STL built-in copy/assignment
-  *target = attr;
+  assert(!sparse_);
+  const float* values = columns_[var].values;
+  target->assign(values, values + size());
+}
+
+RowView::RowView(const InstanceSet& set, const weight_list& weights) :
+                                          set_(set), permuted_attr_(-1) {
+  weights.zeros(&rows_);
+}
+
+RowView::RowView(const InstanceSet& set, const vector<int>& rows) :
+                                set_(set), rows_(rows), permuted_attr_(-1) {}
+
+/**
+ * Shuffle an attribute among the rows (Fisher-Yates, so every
+ * permutation is equally likely)
+ */
+void RowView::permute(int attr, Random* rng) {
+  permuted_ = rows_;
+  for (int i = int(permuted_.size()) - 1; i > 0; --i) {
+    swap(permuted_[i], permuted_[rng->uniform(i + 1)]);
+  }
+  permuted_attr_ = attr;
 }
 
 } // namespace
@@ -4,6 +4,17 @@
  * This is the abstraction for a data set
  * -- Currently libSVM, CSV
  * -- want to support ARFF
+ *
+ * CSV data is stored densely, one column per attribute.
+ * libSVM data is stored sparsely: each attribute keeps only its
+ * nonzero values and their instance numbers (compressed sparse columns),
+ * and anything not stored is 0.
+ *
+ * Every attribute is reached through a small column table, which points
+ * either at the set's own storage or, for a set made by feature_select,
+ * at the columns of the set it was selected from (nothing is copied).
+ * RowView does the same for a subset of the instances. A dense set
+ * loaded by load_binary serves its columns from the mapped file.
  */
 #ifndef _INSTANCE_SET_H_
 #define _INSTANCE_SET_H_
@@ -12,6 +23,8 @@
 #include <vector>
 #include <fstream>
 #include "librf/discrete_dist.h"
+#include "librf/types.h"
+#include "librf/random.h"
 
 using namespace std;
 
@@ -26,31 +39,66 @@ class InstanceSet {
     public:
         /// Empty constructor
         InstanceSet();
+        ~InstanceSet();
         /// Named constructor - create a subset from an existing instanceset
         static InstanceSet* create_subset(const InstanceSet&, const weight_list&);
         /// Named constructor - no labels
         static InstanceSet* load_unsupervised(const string& data,
                                               unsigned int* seed,
                                               bool header = false,
-                                              const string& delim =",");
-        /// Named constructor - feature selection
+                                              const string& delim =",",
+                                              int num_threads = 1);
+        /// Named constructor - feature selection: a view sharing the
+        /// columns of the set (which must outlive it)
         static InstanceSet* feature_select(const InstanceSet&, const vector<int>&);
         /// Named constructor - load from csv file and a label file
+        /// (NULL if either is malformed, or their sizes differ)
         static InstanceSet* load_csv_and_labels(const string& data,
                                                     const string& labels,
                                                     bool header = false,
-                                                    const string& delim =",");
+                                                    const string& delim =",",
+                                                    int num_threads = 1);
+        /// Named constructor - load a (sparse) libsvm file
+        /// (NULL if it is empty or malformed)
+        static InstanceSet* load_libsvm(const string& filename,
+                                        int num_features = -1);
+        /// Named constructor - load a set saved by write_binary
+        /// (NULL if it is not a valid data file). The columns, sorted
+        /// indices and bins of a dense set are served from the mapped
+        /// file, which the set keeps until it is deleted
+        static InstanceSet* load_binary(const string& filename);
+        /// Does the file start like a binary data file?
+        static bool is_binary(const string& filename);
         /// copy a variable array out 
         void save_var(int var, vector<float> *target);
         /// load a variable array in
         void load_var(int var, const vector<float>&);
         /// permute a variable's instances (shuffle)
         void permute(int var, unsigned int * seed);
-        /// sort the variables 
-        void create_sorted_indices();
-        /// Sorted indices (available after create_sorted_indices)
-        const vector<int>& get_sorted_indices(int attribute) const{
-            return sorted_indices_[attribute];
+        /// sort the variables (num_threads <= 0: all processors)
+        void create_sorted_indices(int num_threads = 1);
+        /// Sorted indices, size() of them (available after
+        /// create_sorted_indices)
+        const int* get_sorted_indices(int attribute) const{
+            return columns_[attribute].sorted;
+        }
+        /// quantize the variables (trees are then grown from the bins)
+        void create_bins(int max_bins = 256);
+        /// Whether create_bins has been called
+        bool binned() const {
+          return binned_;
+        }
+        /// Get a particular instance's bin for an attribute
+        uchar get_bin(int i, int attr) const {
+          return columns_[attr].bins[i];
+        }
+        /// Number of bins used for an attribute
+        int num_bins(int attr) const {
+          return columns_[attr].cuts->size() + 1;
+        }
+        /// Boundary between bin b and b+1 (value < cut is bin <= b)
+        float bin_cut(int attr, int b) const {
+          return (*columns_[attr].cuts)[b];
         }
         /// Most common label
         int mode_label() const {
@@ -60,17 +108,48 @@ class InstanceSet {
         unsigned char label(int i) const{
           return labels_[i];
         }
+        /// Get a particular instance's (sample) weight -- 1 unless
+        /// weights were set
+        float weight(int i) const {
+          return weights_.empty() ? 1 : weights_[i];
+        }
+        /// Whether the instances have sample weights
+        bool weighted() const {
+          return !weights_.empty();
+        }
+        /// Set real valued sample weights (one per instance, >= 0),
+        /// ex. to reweight a rare class instead of oversampling it
+        void set_weights(const vector<float>& weights);
+        /// Load sample weights from a file (one per line, in instance
+        /// order). false if there isn't one per instance
+        bool load_weights(const string& filename);
         /// Number of instances
         unsigned int size() const {
             return labels_.size();
         }
         /// Number of attributes
         unsigned int num_attributes() const {
-          return attributes_.size();
+          return columns_.size();
         }
         /// Get a particular instance's attribute
         float get_attribute(int i, int attr) const {
-          return attributes_[attr][i];
+          if (sparse_) {
+            return sparse_attribute(i, attr);
+          }
+          return columns_[attr].values[i];
+        }
+        /// Whether the attributes are stored sparsely
+        bool sparse() const {
+          return sparse_;
+        }
+        /// Instances with a nonzero value for an attribute (ascending)
+        /// (sparse sets only)
+        const vector<uint32>& nonzero_instances(int attr) const {
+          return *columns_[attr].nonzero_instances;
+        }
+        /// Nonzero values of an attribute (same order as nonzero_instances)
+        const vector<float>& nonzero_values(int attr) const {
+          return *columns_[attr].nonzero_values;
         }
         /// Get a variable name (useful if there is a header with var
         //names)
@@ -79,27 +158,39 @@ class InstanceSet {
         }
         void write_csv(ostream& out, bool header, const string& delim);
         void write_transposed_csv(ostream& out, const string& delim);
+        /// Save columns, labels, var names, sorted indices, sample
+        /// weights and bins
+        void write_binary(ostream& out) const;
+        /// Whether the columns belong to another set (feature_select)
+        bool view() const {
+          return view_;
+        }
         //float class_entropy() const{
         //  return distribution_.entropy_over_classes();
         //}
     private:
-        /// Load from csv file and labels
-        InstanceSet(const string& csv_data, const string& labels,
-                    bool header=false, const string& delim=",");
-        // Load csv for unsupervised
-        InstanceSet(const string& csv_data, unsigned int* seed,
-                    bool header=false, const string& delim=",");
-        /// Load from libsvm format
-        InstanceSet(const string& filename, int num);
+        // not copyable (the columns may point into a mapping)
+        InstanceSet(const InstanceSet&);
+        InstanceSet& operator=(const InstanceSet&);
         /// Get a subset of an existing instance set
         InstanceSet(const InstanceSet&, const weight_list&);
         /// Feature select from existing instance set
         InstanceSet(const InstanceSet&, const vector<int>&);
-        void load_labels(istream& in);
-        void load_csv(istream& in, bool header, const string& delim);
-        void load_svm(istream& in);
+        bool load_labels(istream& in);
+        static int true_label(float label);
+        /// false (and nothing loaded) if the file can't be read or a
+        /// line doesn't have as many fields as the first one
+        bool load_csv(const string& filename, bool header,
+                      const string& delim, int num_threads);
+        void add_synthetic(unsigned int* seed);
+        int load_svm(istream& in);
         void create_dummy_var_names(int n);
-        void sort_attribute(const vector<float>&attribute, vector<int>*indices);
+        static void sort_attribute(const float* attribute, int n,
+                                   vector<int>*indices);
+        static void sort_attribute_task(int attr, void* arg);
+        void bin_attribute(int attr, int max_bins);
+        float sparse_attribute(int i, int attr) const;
+        void point_to_storage();
         DiscreteDist distribution_;
         // List of Attribute Lists
         // Thus access is attributes_ [attribute] [ instance]
@@ -107,8 +198,81 @@ class InstanceSet {
         // List of true labels
         // access is labels_ [instance]
         vector<unsigned char> labels_;
+        // Sample weights (empty: all 1)
+        vector<float> weights_;
         vector<string> var_names_;
         vector< vector<int> > sorted_indices_;
+        // Quantized attributes (bins_[attribute][instance]) and the
+        // boundaries between the bins
+        vector< vector<uchar> > bins_;
+        vector< vector<float> > bin_cuts_;
+        // Sparse storage (libsvm), used instead of attributes_:
+        // sparse_values_[attribute][k] is the value of instance
+        // sparse_instances_[attribute][k]
+        bool sparse_;
+        vector< vector<uint32> > sparse_instances_;
+        vector< vector<float> > sparse_values_;
+        // Where the data of an attribute lives (this set's storage, a
+        // mapped binary file, or the storage of the set a view was
+        // selected from)
+        struct attribute_column {
+          const float* values;                   // dense values
+          const int* sorted;                     // NULL until sorted
+          const uchar* bins;                     // NULL unless binned
+          const vector<float>* cuts;
+          const vector<uint32>* nonzero_instances;   // sparse sets
+          const vector<float>* nonzero_values;
+        };
+        vector<attribute_column> columns_;
+        bool binned_;
+        bool view_;
+        // binary data file the columns are served from (NULL if none)
+        void* map_;
+        size_t map_size_;
+};
+
+/**
+ * @brief
+ * Row view: some instances of an InstanceSet, renumbered 0..size()-1.
+ * Nothing is copied (the set must outlive the view). One attribute at a
+ * time can be shuffled among the rows, which is what permutation
+ * importance needs, without touching the set.
+ */
+class RowView {
+    public:
+        /// The instances of set with weight 0 (out-of-bag)
+        RowView(const InstanceSet& set, const weight_list& weights);
+        /// The given instances of set
+        RowView(const InstanceSet& set, const vector<int>& rows);
+        /// Number of instances
+        unsigned int size() const {
+          return rows_.size();
+        }
+        /// Instance number of row i in the underlying set
+        int row(int i) const {
+          return rows_[i];
+        }
+        /// Get a particular row's label
+        unsigned char label(int i) const {
+          return set_.label(rows_[i]);
+        }
+        /// Get a particular row's attribute
+        float get_attribute(int i, int attr) const {
+          int instance = (attr == permuted_attr_) ? permuted_[i] : rows_[i];
+          return set_.get_attribute(instance, attr);
+        }
+        /// shuffle an attribute's values among the rows
+        void permute(int attr, Random* rng);
+        /// undo permute
+        void restore() {
+          permuted_attr_ = -1;
+        }
+    private:
+        const InstanceSet& set_;
+        vector<int> rows_;
+        // rows whose values the permuted attribute reads
+        vector<int> permuted_;
+        int permuted_attr_;
 };
 
 }  // namespace
@@ -0,0 +1,125 @@
+/**
+ * @file
+ * @brief IsolationForest implementation
+ */
+#include "librf/isolation_forest.h"
+#include "librf/tree.h"
+#include "librf/instance_set.h"
+#include "librf/weights.h"
+#include "librf/parallel.h"
+#include "librf/utils.h"
+#include <algorithm>
+#include <functional>
+#include <math.h>
+
+namespace librf {
+
+// Tree growing and scoring arguments, shared by the workers
+struct isolation_context {
+  IsolationForest* forest;
+  uint64 seed;  // tree t draws from stream t
+  int max_depth;
+  // scoring
+  const IsolationForest* scorer;
+  const InstanceSet* set;
+  int limit;
+  vector<pair<float, int> >* ranking;
+};
+
+const int IsolationForest::kScoreBlock = 1024;
+
+IsolationForest::IsolationForest(const InstanceSet& set, int num_trees,
+                                 int sample_size, int limit,
+                                 int num_threads, unsigned int seed)
+    : set_(set), limit_(limit) {
+  if (limit_ == -1) {
+    limit_ = set.size();
+  }
+  sample_size_ = min(sample_size, limit_);
+  isolation_context context;
+  context.forest = this;
+  context.seed = seed;
+  // deep enough for an average (balanced) tree of the sample
+  context.max_depth = int(ceil(log(max(sample_size_, 2)) / log(2.0)));
+  trees_.resize(num_trees, NULL);
+  parallel_for(num_trees, num_threads, grow_tree_task, &context);
+}
+
+IsolationForest::~IsolationForest() {
+  for (int i = 0; i < trees_.size(); ++i) {
+    delete trees_[i];
+  }
+}
+
+/**
+ * Draw the sample (without replacement) and grow a tree from it
+ */
+void IsolationForest::grow_tree_task(int tree_no, void* arg) {
+  isolation_context* context = static_cast<isolation_context*>(arg);
+  IsolationForest* forest = context->forest;
+  Random rng(context->seed, tree_no);
+  const InstanceSet& set = forest->set_;
+  weight_list* w = new weight_list(set.size(), forest->sample_size_);
+  vector<int> order(forest->limit_);
+  for (int i = 0; i < order.size(); ++i) {
+    order[i] = i;
+  }
+  vector<int> sample;
+  random_sample(forest->sample_size_, &order, &sample, &rng);
+  sort(sample.begin(), sample.end());
+  for (int i = 0; i < sample.size(); ++i) {
+    w->add(sample[i]);
+  }
+  Tree* tree = new Tree(set, w, 1, 1, 0, rng.next64());
+  tree->grow_isolation(context->max_depth);
+  forest->trees_[tree_no] = tree;
+}
+
+float IsolationForest::path_length(const InstanceSet& set,
+                                   int instance_no) const {
+  float total = 0;
+  for (int i = 0; i < trees_.size(); ++i) {
+    total += trees_[i]->path_length(set, instance_no);
+  }
+  return total / trees_.size();
+}
+
+float IsolationForest::score(const InstanceSet& set, int instance_no) const {
+  float c = Tree::average_path_length(sample_size_);
+  if (c == 0) {
+    return 0.5;
+  }
+  return pow(2.0, -path_length(set, instance_no) / c);
+}
+
+void IsolationForest::score_block_task(int block, void* arg) {
+  isolation_context* context = static_cast<isolation_context*>(arg);
+  int begin = block * kScoreBlock;
+  int end = min(begin + kScoreBlock, context->limit);
+  for (int i = begin; i < end; ++i) {
+    (*context->ranking)[i] =
+        make_pair(context->scorer->score(*context->set, i), i);
+  }
+}
+
+/**
+ * Score the first limit instances of a set (-1: all of them)
+ */
+void IsolationForest::compute_outliers(const InstanceSet& set,
+                                       vector<pair<float, int> >* ranking,
+                                       int limit, int num_threads) const {
+  if (limit == -1) {
+    limit = set.size();
+  }
+  isolation_context context;
+  context.scorer = this;
+  context.set = &set;
+  context.limit = limit;
+  context.ranking = ranking;
+  ranking->resize(limit);
+  int num_blocks = (limit + kScoreBlock - 1) / kScoreBlock;
+  parallel_for(num_blocks, num_threads, score_block_task, &context);
+  sort(ranking->begin(), ranking->end(), greater<pair<float, int> >());
+}
+
+} // namespace
@@ -0,0 +1,64 @@
+/**
+ * @file
+ * @brief Isolation forest (outlier scores without proximities)
+ *
+ * Every tree is grown on a small random sample of the instances, with
+ * random splits (see Tree::grow_isolation). Outliers are few and
+ * different, so they are isolated close to the root: the score of an
+ * instance is 2^(-E(h) / c(sample size)), where E(h) is its average
+ * path length over the trees and c the average path length of the
+ * sample. Scores near 1 are outliers, scores well below 0.5 are not.
+ *
+ * Scoring is O(#instances * #trees * log(sample size)), against the
+ * O(#instances^2) of RandomForest::compute_outliers, and no proximity
+ * matrix is needed. Labels are not used.
+ */
+#ifndef _ISOLATION_FOREST_H_
+#define _ISOLATION_FOREST_H_
+
+#include <vector>
+#include "librf/types.h"
+
+using namespace std;
+
+namespace librf {
+class InstanceSet;
+class Tree;
+struct isolation_context;
+
+class IsolationForest {
+  public:
+    /**
+     * Grow the forest from the first limit instances of a set
+     * (-1: all of them; ex. the real half of an unsupervised set)
+     * @param sample_size #instances each tree is grown from
+     * @param num_threads #trees grown at once (<= 0: one per processor)
+     * @param seed random seed (the forest does not depend on num_threads)
+     */
+    IsolationForest(const InstanceSet& set, int num_trees,
+                    int sample_size = 256, int limit = -1,
+                    int num_threads = 1, unsigned int seed = 1);
+    ~IsolationForest();
+    /// Average path length of an instance over the trees
+    float path_length(const InstanceSet& set, int instance_no) const;
+    /// Outlier score of an instance (0..1, larger is more anomalous)
+    float score(const InstanceSet& set, int instance_no) const;
+    /// (score, instance) of the first limit instances, largest first
+    void compute_outliers(const InstanceSet& set,
+                          vector<pair<float, int> >* ranking,
+                          int limit = -1, int num_threads = 1) const;
+    int num_trees() const {
+      return trees_.size();
+    }
+  private:
+    static void grow_tree_task(int tree_no, void* arg);
+    static void score_block_task(int block, void* arg);
+    static const int kScoreBlock; // instances per scoring task
+    const InstanceSet& set_;
+    vector<Tree*> trees_;
+    int sample_size_;  // (at most the #instances)
+    int limit_;
+};
+
+} // namespace
+#endif
@@ -11,12 +11,16 @@
  *
  * The important classes are:
  * librf::RandomForest and librf::InstanceSet
+ * (librf::FlatForest packs a trained forest for fast prediction)
  * \section example Example programs
  * \subsection rftrain  rftrain
  * Train a randomforest from a .libsvm or a .csv file.  Saves the
  * randomforest to a file.
  * \subsection rfpredict rfpredict
  * Predict probabilities using a saved random forest.
+ * \subsection rfconvert rfconvert
+ * Convert a saved random forest between the text and the (memory
+ * mappable) binary model format.
  * \subsection rfvarimport rfvarimport
  * Train a random forest and determine variable importances.
  *
@@ -26,5 +30,8 @@
 
 #include "librf/random_forest.h"
 #include "librf/instance_set.h"
+#include "librf/flat_forest.h"
+#include "librf/proximity.h"
+#include "librf/isolation_forest.h"
 
 #endif  // LIBRF_H
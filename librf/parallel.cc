@@ -0,0 +1,77 @@
+/**
+ * @file
+ * @brief worker pool implementation
+ */
+#include "librf/parallel.h"
+#include <pthread.h>
+#include <unistd.h>
+#include <vector>
+
+using namespace std;
+
+namespace librf {
+
+struct work_queue {
+  task_func fn;
+  void* arg;
+  int num_tasks;
+  int next_task;
+  pthread_mutex_t lock;
+};
+
+static void* worker(void* q) {
+  work_queue* queue = static_cast<work_queue*>(q);
+  while (true) {
+    pthread_mutex_lock(&queue->lock);
+    int task = queue->next_task++;
+    pthread_mutex_unlock(&queue->lock);
+    if (task >= queue->num_tasks) {
+      break;
+    }
+    queue->fn(task, queue->arg);
+  }
+  return NULL;
+}
+
+int num_processors() {
+  long n = sysconf(_SC_NPROCESSORS_ONLN);
+  return (n > 0) ? int(n) : 1;
+}
+
+/**
+ * @param num_tasks number of tasks
+ * @param num_threads number of workers (<= 0 means one per processor)
+ * @param fn task function
+ * @param arg passed through to fn
+ */
+void parallel_for(int num_tasks, int num_threads, task_func fn, void* arg) {
+  if (num_threads <= 0) {
+    num_threads = num_processors();
+  }
+  if (num_threads > num_tasks) {
+    num_threads = num_tasks;
+  }
+  // Don't bother with threads for the serial case
+  if (num_threads <= 1) {
+    for (int i = 0; i < num_tasks; ++i) {
+      fn(i, arg);
+    }
+    return;
+  }
+  work_queue queue;
+  queue.fn = fn;
+  queue.arg = arg;
+  queue.num_tasks = num_tasks;
+  queue.next_task = 0;
+  pthread_mutex_init(&queue.lock, NULL);
+  vector<pthread_t> threads(num_threads);
+  for (int i = 0; i < num_threads; ++i) {
+    pthread_create(&threads[i], NULL, worker, &queue);
+  }
+  for (int i = 0; i < num_threads; ++i) {
+    pthread_join(threads[i], NULL);
+  }
+  pthread_mutex_destroy(&queue.lock);
+}
+
+} // namespace
@@ -0,0 +1,22 @@
+/**
+ * @file
+ * @brief Minimal worker pool (pthreads)
+ *
+ * Tasks are numbered 0..num_tasks-1 and handed out one at a time to
+ * the workers, so a task should be a reasonably large chunk of work
+ * (ex. growing a whole tree).
+ */
+#ifndef _PARALLEL_H_
+#define _PARALLEL_H_
+
+namespace librf {
+
+typedef void (*task_func)(int task, void* arg);
+
+/// Run fn(task, arg) for every task on num_threads workers (blocks)
+void parallel_for(int num_tasks, int num_threads, task_func fn, void* arg);
+/// Number of online processors (used when num_threads <= 0)
+int num_processors();
+
+} // namespace
+#endif
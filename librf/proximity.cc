@@ -0,0 +1,69 @@
+/**
+ * @file
+ * @brief ProximityMatrix implementation
+ */
+#include "librf/proximity.h"
+#include <algorithm>
+
+namespace librf {
+
+// order by instance
+static bool instance_less(const pair<int, float>& a,
+                          const pair<int, float>& b) {
+  return a.first < b.first;
+}
+
+// larger proximities first (ties: smaller instance first)
+static bool proximity_greater(const pair<int, float>& a,
+                              const pair<int, float>& b) {
+  return a.second > b.second || (a.second == b.second && a.first < b.first);
+}
+
+float ProximityMatrix::get(int i, int j) const {
+  const vector<pair<int, float> >& r = rows_[i];
+  vector<pair<int, float> >::const_iterator it =
+      lower_bound(r.begin(), r.end(), make_pair(j, 0.0f), instance_less);
+  if (it == r.end() || it->first != j) {
+    return 0;
+  }
+  return it->second;
+}
+
+void ProximityMatrix::keep_top(int k) {
+  for (int i = 0; i < rows_.size(); ++i) {
+    keep_top(&rows_[i], k);
+  }
+}
+
+void ProximityMatrix::keep_top(vector<pair<int, float> >* row, int k) {
+  if (row->size() <= k) {
+    return;
+  }
+  nth_element(row->begin(), row->begin() + k, row->end(), proximity_greater);
+  row->resize(k);
+  sort(row->begin(), row->end(), instance_less);
+}
+
+size_t ProximityMatrix::num_entries() const {
+  size_t entries = 0;
+  for (int i = 0; i < rows_.size(); ++i) {
+    entries += rows_[i].size();
+  }
+  return entries;
+}
+
+void ProximityMatrix::write_dense_row(ostream& o, int i) const {
+  const vector<pair<int, float> >& r = rows_[i];
+  int next = 0;
+  for (int j = 0; j < rows_.size(); ++j) {
+    if (next < r.size() && r[next].first == j) {
+      o << r[next].second << " ";
+      ++next;
+    } else {
+      o << "0 ";
+    }
+  }
+  o << endl;
+}
+
+} // namespace
@@ -0,0 +1,70 @@
+/**
+ * @file
+ * @brief Sparse proximity matrix
+ *
+ * The proximity of two instances is the fraction of trees in which they
+ * land in the same leaf. Most pairs never do, so only the pairs that
+ * share a leaf at least once are kept: row i lists (j, proximity) for
+ * those instances j, by increasing j. The matrix is symmetric (unless
+ * it was cut down with keep_top) and the diagonal is not stored.
+ *
+ * See RandomForest::compute_proximity for how it is filled in.
+ *
+ * RandomForest::write_proximity writes the dense matrix to a binary file
+ * instead (for sets too large to keep it in memory):
+ *  - header (proximity_file_header)
+ *  - n rows of n values: float32, or uint16 holding proximity * 65535
+ * Files are written in the byte order of the host.
+ */
+#ifndef _PROXIMITY_H_
+#define _PROXIMITY_H_
+
+#include <vector>
+#include <iostream>
+#include "librf/types.h"
+
+using namespace std;
+
+namespace librf {
+
+/// Value type of a proximity file
+enum { PROXIMITY_FLOAT = 0, PROXIMITY_UINT16 = 1 };
+
+/// Header of a proximity file
+struct proximity_file_header {
+  char magic[4];          // "LRFP"
+  uint32 version;         // 1
+  uint32 num_instances;   // n
+  uint32 format;          // PROXIMITY_FLOAT or PROXIMITY_UINT16
+};
+
+static const char kProximityMagic[4] = {'L', 'R', 'F', 'P'};
+
+class ProximityMatrix {
+  public:
+    /// Empty matrix (filled in by RandomForest::compute_proximity)
+    ProximityMatrix() {}
+    /// Number of rows (instances)
+    int size() const {
+      return rows_.size();
+    }
+    /// Nonzero proximities of instance i as (instance, proximity)
+    const vector<pair<int, float> >& row(int i) const {
+      return rows_[i];
+    }
+    /// Proximity of instances i and j (0 unless it is stored)
+    float get(int i, int j) const;
+    /// Keep only the k largest proximities of every row
+    void keep_top(int k);
+    /// Number of stored proximities
+    size_t num_entries() const;
+    /// Write row i as a line of n space separated values (zeros included)
+    void write_dense_row(ostream& o, int i) const;
+  private:
+    friend class RandomForest;
+    static void keep_top(vector<pair<int, float> >* row, int k);
+    vector<vector<pair<int, float> > > rows_;
+};
+
+} // namespace
+#endif
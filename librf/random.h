@@ -0,0 +1,66 @@
+/**
+ * @file
+ * @brief Counter-based random number streams
+ *
+ * Draw i of a stream is a hash (the SplitMix64 finalizer) of the
+ * stream's key plus i times a fixed odd constant, so a stream is just a
+ * key and a counter: there is no shared state to lock, and a stream can
+ * be derived for every tree (and every node of a tree) from one master
+ * seed. Results then only depend on that seed, whatever the number of
+ * threads or the order in which the trees are grown.
+ *
+ * Draws are 64 bits wide, and uniform() rejects the few values that
+ * would bias a modulo, so any range size works (unlike rand() % n,
+ * which is biased and capped at RAND_MAX).
+ */
+#ifndef _RANDOM_H_
+#define _RANDOM_H_
+
+#include "librf/types.h"
+
+namespace librf {
+
+class Random {
+  public:
+    /// Stream number stream of a seed
+    explicit Random(uint64 seed = 0, uint64 stream = 0)
+        : key_(mix(mix(seed) + (stream + 1) * kGamma)), counter_(0) {}
+    /// An independent stream derived from this one (ex. per node of a tree)
+    Random stream(uint64 id) const {
+      return Random(key_, id);
+    }
+    /// Next 64 random bits
+    uint64 next64() {
+      return mix(key_ + (++counter_) * kGamma);
+    }
+    /// Next 32 random bits
+    uint32 next() {
+      return uint32(next64() >> 32);
+    }
+    /// Uniform in [0, n), n > 0
+    uint64 uniform(uint64 n) {
+      // the lowest (2^64 mod n) values would make a modulo biased
+      uint64 threshold = (0 - n) % n;
+      uint64 r;
+      do {
+        r = next64();
+      } while (r < threshold);
+      return r % n;
+    }
+    /// Uniform in [0, 1)
+    double uniform_real() {
+      return (next64() >> 11) * (1.0 / 9007199254740992.0);
+    }
+  private:
+    static uint64 mix(uint64 z) {
+      z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+      z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+      return z ^ (z >> 31);
+    }
+    static const uint64 kGamma = 0x9e3779b97f4a7c15ULL;
+    uint64 key_;
+    uint64 counter_;
+};
+
+} // namespace
+#endif
@@ -6,39 +6,259 @@
 #include "librf/tree.h"
 #include "librf/instance_set.h"
 #include "librf/weights.h"
+#include "librf/parallel.h"
+#include "librf/proximity.h"
+#include "librf/utils.h"
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
 #include <fstream>
 #include <algorithm>
+#include <stdlib.h>
+#include <limits.h>
+#include <pthread.h>
 namespace librf {
 
-RandomForest::RandomForest() : set_(InstanceSet()) {}
+// Per-forest state shared by the tree growing workers
+struct grow_context {
+  RandomForest* forest;
+  uint64 seed;
+  bag_options bagging;
+  // the instances of each label (stratified and balanced bags)
+  vector<vector<int> > by_label;
+  // n ln(n) table shared (read only) by the tree builders (entropy)
+  vector<double> nlogn;
+  pthread_mutex_t log_lock;
+};
+
+// Arguments of a batch prediction, shared by the block workers
+struct predict_context {
+  const RandomForest* forest;
+  // rows come from an instance set, or from row-major feature vectors
+  const InstanceSet* set;
+  const float* rows;
+  size_t stride;
+  int num_features;
+  int begin;
+  int end;
+  int label;
+  int* labels;   // predicted labels go here (if not NULL)
+  float* probs;  // otherwise probabilities of label go here
+};
+
+// Permutation importance: every (tree, used variable) pair is a task
+struct importance_context {
+  const RandomForest* forest;
+  vector<int> correct;              // per tree, before permuting
+  uint64 seed;                      // tree t, variable v: stream
+                                    // Random(seed, t).stream(v)
+  vector<pair<int, int> > pairs;    // (tree, variable)
+  vector<int> scores;               // per pair: decrease in #correct
+};
+
+// Sparse proximity: the leaves of every tree group the instances, and
+// each row is counted from the groups its instance belongs to
+struct proximity_context {
+  const RandomForest* forest;
+  const InstanceSet* set;
+  int limit;
+  int top_k;
+  // per tree: leaf of every instance, the instances ordered by leaf and
+  // where the instances of each leaf start in that order
+  vector<vector<int> > leaves;
+  vector<vector<int> > by_leaf;
+  vector<vector<int> > leaf_start;
+  ProximityMatrix* prox;
+  // file output (write_proximity)
+  int fd;
+  int format;
+  bool failed;
+};
+
+const int RandomForest::kPredictBlock = 256;
+// largest weight per draw the n ln(n) table is built for
+const double RandomForest::kMaxTableWeight = 4;
+const int RandomForest::kMaxTrees = 65535;
+const int RandomForest::kProximityBlock = 512;
+
+RandomForest::RandomForest() : set_(InstanceSet()), num_labels_(2) {}
 /**
  * @param set training data
- * @param num_trees #trees to train
+ * @param num_trees #trees to train (at most kMaxTrees)
  * @param K #random vars to consider at each split
  * number of instances)
+ * @param weights class weights, one per label (real valued; missing
+ * ones are 1, extra ones are dropped; every draw of an instance
+ * counts with its class weight times its sample weight, see
+ * InstanceSet::set_weights)
+ * @param num_threads #trees grown at once (<= 0 means one per processor)
+ * @param seed random seed - the forest only depends on this seed, not on
+ * num_threads
+ * @param criterion impurity measure used to pick splits
+ * @param bagging how the bag of each tree is drawn
  */
 RandomForest::RandomForest(const InstanceSet& set,
                            int num_trees,
                            int K,
-                           const vector<int>& weights) :set_(set), K_(K) {
-  if (weights.size() == 0) {
-    class_weights_.resize(2, 1); //HARDCODE
-  } else {
-    class_weights_ = weights;
-  }
+                           const vector<float>& weights,
+                           int num_threads,
+                           unsigned int seed,
+                           SplitCriterionType criterion,
+                           const bag_options& bagging) :set_(set), K_(K),
+                                               criterion_(criterion) {
   // cout << "RandomForest Constructor " << num_trees << endl;
+  if (num_trees > kMaxTrees) {
+    // (more would wrap the OOB vote counts around)
+    cerr << "Too many trees (" << num_trees << "): growing " << kMaxTrees
+         << endl;
+    num_trees = kMaxTrees;
+  }
+  num_labels_ = 2;
+  for (int i = 0; i < set_.size(); ++i) {
+    num_labels_ = max(num_labels_, set_.label(i) + 1);
+  }
+  class_weights_ = weights;
+  if (!weights.empty() && weights.size() != num_labels_) {
+    cerr << weights.size() << " class weights for " << num_labels_
+         << " labels: the missing ones are 1" << endl;
+  }
+  // one per label (Tree::instance_weight looks them up by label)
+  class_weights_.resize(num_labels_, 1);
+  oob_votes_.assign(set_.size() * num_labels_, 0);
+  trees_.resize(num_trees, NULL);
+  grow_context context;
+  context.forest = this;
+  context.seed = seed;
+  context.bagging = bagging;
+  if (bagging.sampling != BAG_RANDOM) {
+    context.by_label.resize(num_labels_);
+    for (int i = 0; i < set_.size(); ++i) {
+      context.by_label[set_.label(i)].push_back(i);
+    }
+  }
+  if (criterion_ == ENTROPY) {
+    nlogn_table(bagging, &context.nlogn);
+  }
+  pthread_mutex_init(&context.log_lock, NULL);
+  parallel_for(num_trees, num_threads, grow_tree_task, &context);
+  pthread_mutex_destroy(&context.log_lock);
+  impurity_importance_.resize(set_.num_attributes(), 0);
   for (int i = 0; i < num_trees; ++i) {
-    weight_list* w = new weight_list(set.size(), set.size());
-    // sample with replacement
-    for (int j = 0; j < set.size(); ++j) {
-      int instance = rand() % set.size();
-      w->add(instance, class_weights_[set.label(instance)]);
+    const vector<float>& decrease = trees_[i]->impurity_decrease();
+    for (int j = 0; j < decrease.size(); ++j) {
+      impurity_importance_[j] += decrease[j] / num_trees;
+    }
+  }
+}
+
+/**
+ * The n ln(n) table of the entropy, built once for all the trees
+ * It covers the largest total weight a bag can have, if every
+ * instance weight is an integer. It is only worth it (and only small)
+ * while that stays close to the #draws: past kMaxTableWeight per draw
+ * the trees compute w ln(w) instead.
+ */
+void RandomForest::nlogn_table(const bag_options& bagging,
+                               vector<double>* table) const {
+  float max_weight = 0;
+  for (int i = 0; i < set_.size(); ++i) {
+    float weight = set_.weight(i) * class_weights_[set_.label(i)];
+    if (weight != floor(weight)) {
+      return;
+    }
+    max_weight = max(max_weight, weight);
+  }
+  // (stratified and balanced bags round the draws of every label)
+  double draws = double(bagging.fraction) * set_.size() + num_labels_;
+  double total = draws * min(double(max_weight), kMaxTableWeight);
+  if (total < INT_MAX) {
+    DiscreteDist::nlogn_table(int(total), table);
+  }
+}
+
+void RandomForest::grow_tree_task(int tree_no, void* arg) {
+  grow_context* context = static_cast<grow_context*>(arg);
+  RandomForest* forest = context->forest;
+  forest->grow_tree(tree_no, *context);
+  // the tree's OOB votes are predicted here, and only added up under
+  // the lock (so the counts do not depend on the order of the trees)
+  const Tree* tree = forest->trees_[tree_no];
+  vector<int> rows;
+  tree->oob_instances(&rows);
+  vector<int> votes(rows.size());
+  for (int k = 0; k < rows.size(); ++k) {
+    votes[k] = rows[k] * forest->num_labels_ +
+               tree->predict(forest->set_, rows[k]);
+  }
+  pthread_mutex_lock(&context->log_lock);
+  for (int k = 0; k < votes.size(); ++k) {
+    forest->oob_votes_[votes[k]]++;
+  }
+  cout << "Grew tree " << tree_no << endl;
+  pthread_mutex_unlock(&context->log_lock);
+}
+
+// Draw count of the instances pool (NULL: all num_instances of them)
+static void draw_bag(const vector<int>* pool, int num_instances, int count,
+                     bool replacement, Random* rng, vector<int>* bag) {
+  int size = pool ? pool->size() : num_instances;
+  if (size == 0) {
+    return;
+  }
+  if (replacement) {
+    for (int j = 0; j < count; ++j) {
+      int k = rng->uniform(size);
+      bag->push_back(pool ? (*pool)[k] : k);
+    }
+    return;
+  }
+  vector<int> order(size);
+  for (int k = 0; k < size; ++k) {
+    order[k] = pool ? (*pool)[k] : k;
+  }
+  vector<int> sample;
+  random_sample(count, &order, &sample, rng);
+  bag->insert(bag->end(), sample.begin(), sample.end());
+}
+
+/**
+ * Bag the training set and grow a single tree
+ * (safe to call from several threads at once)
+ * Every tree draws from its own stream of the seed, so the trees don't
+ * depend on which worker grows them (or in what order)
+ */
+void RandomForest::grow_tree(int tree_no, const grow_context& context) {
+  Random rng(context.seed, tree_no);
+  const bag_options& bagging = context.bagging;
+  int n = set_.size();
+  vector<int> bag;
+  if (bagging.sampling == BAG_RANDOM) {
+    draw_bag(NULL, n, int(double(bagging.fraction) * n + 0.5),
+             bagging.replacement, &rng, &bag);
+  } else {
+    int num_present = 0;
+    for (int c = 0; c < num_labels_; ++c) {
+      num_present += !context.by_label[c].empty();
     }
-    Tree* tree = new Tree(set, w,  K, 1, 0, rand());
-    tree->grow();
-    cout << "Grew tree " << i << endl;
-    trees_.push_back(tree);
+    for (int c = 0; c < num_labels_; ++c) {
+      const vector<int>& pool = context.by_label[c];
+      float share = (bagging.sampling == BAG_STRATIFIED) ?
+                    pool.size() : float(n) / num_present;
+      draw_bag(&pool, n, int(double(bagging.fraction) * share + 0.5),
+               bagging.replacement, &rng, &bag);
+    }
+  }
+  // (in instance order, so small bags can be stored sparsely)
+  sort(bag.begin(), bag.end());
+  weight_list* w = new weight_list(n, bag.size());
+  for (int j = 0; j < bag.size(); ++j) {
+    w->add(bag[j]);
   }
+  Tree* tree = new Tree(set_, w, K_, 1, 0, rng.next64(), criterion_,
+                        class_weights_);
+  tree->grow(context.nlogn.empty() ? NULL : &context.nlogn);
+  trees_[tree_no] = tree;
 }
 
 RandomForest::~RandomForest() {
@@ -58,14 +278,46 @@ void RandomForest::write(ostream& o) {
   for (int i = 0; i < trees_.size(); ++i) {
     trees_[i]->write(o);
   }
+  write_importance(o, impurity_importance_);
 }
 
 void RandomForest::read(istream& in) {
   int num_trees, K;
   in >> num_trees >> K;
+  K_ = K;
   for (int i = 0; i < num_trees; ++i) {
     trees_.push_back(new Tree(in));
   }
+  read_importance(in, &impurity_importance_);
+}
+
+/**
+ * Importance section at the end of a model
+ * ("Importance: <#vars>" and a line of values; nothing if empty)
+ */
+void RandomForest::write_importance(ostream& o,
+                                    const vector<float>& importance) {
+  if (importance.empty()) {
+    return;
+  }
+  o << "Importance: " << importance.size() << endl;
+  for (int i = 0; i < importance.size(); ++i) {
+    o << (i > 0 ? " " : "") << importance[i];
+  }
+  o << endl;
+}
+
+// (models written before the section existed just end)
+void RandomForest::read_importance(istream& in, vector<float>* importance) {
+  string spacer;
+  int num_vars;
+  if (!(in >> spacer >> num_vars) || spacer != "Importance:") {
+    return;
+  }
+  importance->resize(num_vars);
+  for (int i = 0; i < num_vars; ++i) {
+    in >> (*importance)[i];
+  }
 }
 
 int RandomForest::predict(const InstanceSet& set, int instance_no) const {
@@ -78,6 +330,156 @@ int RandomForest::predict(const InstanceSet& set, int instance_no) const {
   return votes.mode();
 }
 
+/**
+ * Gather the votes of every tree for rows [begin, end)
+ * Tree-major: each tree is walked for the whole block before the next
+ * one, so its nodes stay in cache across the rows.
+ */
+void RandomForest::vote_block(const predict_context& c, int begin, int end,
+                              vector<DiscreteDist>* votes) const {
+  for (int t = 0; t < trees_.size(); ++t) {
+    const Tree* tree = trees_[t];
+    if (c.set != NULL) {
+      for (int i = begin; i < end; ++i) {
+        (*votes)[i - begin].add(tree->predict(*c.set, i));
+      }
+    } else {
+      for (int i = begin; i < end; ++i) {
+        (*votes)[i - begin].add(tree->predict(c.rows + size_t(i) * c.stride,
+                                              c.num_features));
+      }
+    }
+  }
+}
+
+void RandomForest::predict_block_task(int block, void* arg) {
+  predict_context* c = static_cast<predict_context*>(arg);
+  int begin = c->begin + block * kPredictBlock;
+  int end = min(begin + kPredictBlock, c->end);
+  vector<DiscreteDist> votes(end - begin);
+  c->forest->vote_block(*c, begin, end, &votes);
+  for (int i = begin; i < end; ++i) {
+    if (c->labels != NULL) {
+      c->labels[i - c->begin] = votes[i - begin].mode();
+    } else {
+      c->probs[i - c->begin] = votes[i - begin].percentage(c->label);
+    }
+  }
+}
+
+// Split the rows of a batch into blocks and score them (in parallel)
+void RandomForest::predict_rows(predict_context* context,
+                                int num_threads) const {
+  context->forest = this;
+  int num_blocks = (context->end - context->begin + kPredictBlock - 1) /
+                   kPredictBlock;
+  parallel_for(num_blocks, num_threads, predict_block_task, context);
+}
+
+/**
+ * Same result as calling predict for each instance
+ * @param set data set
+ * @param begin first instance
+ * @param end one past the last instance
+ * @param out caller allocated, end - begin entries
+ * @param num_threads #blocks of rows scored at once (<= 0: all processors)
+ */
+void RandomForest::predict_batch(const InstanceSet& set, int begin, int end,
+                                 int* out, int num_threads) const {
+  assert(0 <= begin && begin <= end && end <= set.size());
+  predict_context context = {NULL, &set, NULL, 0, 0, begin, end,
+                             0, out, NULL};
+  predict_rows(&context, num_threads);
+}
+
+/**
+ * Same result as calling predict_prob for each instance
+ * @param out caller allocated, end - begin entries
+ * (see predict_batch for the other arguments)
+ */
+void RandomForest::predict_prob_batch(const InstanceSet& set,
+                                      int begin, int end,
+                                      int label, float* out,
+                                      int num_threads) const {
+  assert(0 <= begin && begin <= end && end <= set.size());
+  predict_context context = {NULL, &set, NULL, 0, 0, begin, end,
+                             label, NULL, out};
+  predict_rows(&context, num_threads);
+}
+
+// Votes of every tree for a raw feature vector (labels < 256)
+int RandomForest::vote(const float* features, int num_features,
+                       unsigned int* votes) const {
+  int num_labels = 2;
+  for (int i = 0; i < 256; ++i) {
+    votes[i] = 0;
+  }
+  for (int i = 0; i < trees_.size(); ++i) {
+    int predict = trees_[i]->predict(features, num_features);
+    votes[predict]++;
+    if (predict >= num_labels) {
+      num_labels = predict + 1;
+    }
+  }
+  return num_labels;
+}
+
+/**
+ * Predict the label of a single feature vector
+ * Nothing is allocated, so this is safe to call from a serving thread
+ * @param features the attribute values of one instance
+ * @param num_features length of features (at least #attributes trained on)
+ */
+int RandomForest::predict(const float* features, int num_features) const {
+  unsigned int votes[256];
+  int num_labels = vote(features, num_features, votes);
+  // ties go to the smaller label (as in DiscreteDist::mode)
+  int mode = 0;
+  for (int i = 1; i < num_labels; ++i) {
+    if (votes[i] > votes[mode]) {
+      mode = i;
+    }
+  }
+  return mode;
+}
+
+/// Predict probability of given label for a single feature vector
+float RandomForest::predict_prob(const float* features, int num_features,
+                                 int label) const {
+  unsigned int votes[256];
+  vote(features, num_features, votes);
+  return float(votes[label]) / trees_.size();
+}
+
+/**
+ * Predict the labels of row-major feature vectors
+ * @param rows row i starts at rows[i * stride]
+ * @param num_rows #rows
+ * @param num_features #features of each row
+ * @param stride distance between rows (in floats, >= num_features)
+ * @param out caller allocated, num_rows entries
+ * @param num_threads #blocks of rows scored at once (<= 0: all processors)
+ */
+void RandomForest::predict_batch(const float* rows, size_t num_rows,
+                                 int num_features, size_t stride,
+                                 int* out, int num_threads) const {
+  assert(stride >= size_t(num_features) && num_rows <= INT_MAX);
+  predict_context context = {NULL, NULL, rows, stride, num_features,
+                             0, int(num_rows), 0, out, NULL};
+  predict_rows(&context, num_threads);
+}
+
+/// Predict probabilities of given label for row-major feature vectors
+void RandomForest::predict_prob_batch(const float* rows, size_t num_rows,
+                                      int num_features, size_t stride,
+                                      int label, float* out,
+                                      int num_threads) const {
+  assert(stride >= size_t(num_features) && num_rows <= INT_MAX);
+  predict_context context = {NULL, NULL, rows, stride, num_features,
+                             0, int(num_rows), label, NULL, out};
+  predict_rows(&context, num_threads);
+}
+
 int RandomForest::predict(const InstanceSet& set, int instance_no,
                           vector<pair<int, float> >*nodes) const {
   // Gather the votes from each tree
@@ -93,12 +495,24 @@ void RandomForest::reliability_diagram(const InstanceSet&set,
                                        int bins,
                                        vector<pair<float, float> >*out,
                                        vector<int>* count, int label) const {
+  vector<float> probs(set.size());
+  if (set.size() > 0) {
+    predict_prob_batch(set, 0, set.size(), label, &probs[0]);
+  }
+  reliability_diagram(set, probs, bins, out, count, label);
+}
+
+void RandomForest::reliability_diagram(const InstanceSet& set,
+                                       const vector<float>& probs,
+                                       int bins,
+                                       vector<pair<float, float> >*out,
+                                       vector<int>* count, int label) {
   float increment = 1.0 / bins;
   float half = increment / 2.0;
   vector<DiscreteDist> bin_dists(bins);
   count->resize(bins, 0);
   for (int i = 0; i < set.size(); ++i) {
-    float prob = predict_prob(set, i, label);
+    float prob = probs[i];
     int bin_no = int(floor(prob/increment));
     if (bin_no == bins) {
       bin_no = bins - 1;
@@ -124,6 +538,10 @@ void RandomForest::reliability_diagram(int bins,
   vector<DiscreteDist> bin_dists(bins);
   count->resize(bins, 0);
   for (int i = 0; i < set_.size(); ++i) {
+    // (never out of bag: no estimate)
+    if (oob_vote_total(i) == 0) {
+      continue;
+    }
     float prob = oob_predict_prob(i, label);
     int bin_no = int(floor(prob/increment));
     if (bin_no == bins) {
@@ -168,6 +586,232 @@ void RandomForest::compute_proximity(const InstanceSet& set,
   }
 }
 
+void RandomForest::proximity_tree_task(int tree_no, void* arg) {
+  proximity_context* context = static_cast<proximity_context*>(arg);
+  const Tree* tree = context->forest->trees_[tree_no];
+  int limit = context->limit;
+  vector<int>& leaves = context->leaves[tree_no];
+  vector<int>& by_leaf = context->by_leaf[tree_no];
+  vector<int>& start = context->leaf_start[tree_no];
+  leaves.resize(limit);
+  by_leaf.resize(limit);
+  for (int i = 0; i < limit; ++i) {
+    tree->predict(*context->set, i, &leaves[i]);
+  }
+  // counting sort by leaf (instances stay in order within a leaf)
+  start.assign(tree->num_nodes() + 1, 0);
+  for (int i = 0; i < limit; ++i) {
+    start[leaves[i] + 1]++;
+  }
+  for (int l = 0; l < tree->num_nodes(); ++l) {
+    start[l + 1] += start[l];
+  }
+  vector<int> next(start.begin(), start.end() - 1);
+  for (int i = 0; i < limit; ++i) {
+    by_leaf[next[leaves[i]]++] = i;
+  }
+}
+
+// Count the trees in which instance i shares a leaf with every other
+// instance: counts[j] for each j in touched (unordered)
+static void count_proximity_row(const proximity_context& context, int i,
+                                vector<uint32>* counts,
+                                vector<int>* touched) {
+  touched->clear();
+  for (int t = 0; t < context.leaves.size(); ++t) {
+    int leaf = context.leaves[t][i];
+    const int* members = &context.by_leaf[t][0];
+    for (int m = context.leaf_start[t][leaf];
+         m < context.leaf_start[t][leaf + 1]; ++m) {
+      int j = members[m];
+      if (j != i && (*counts)[j]++ == 0) {
+        touched->push_back(j);
+      }
+    }
+  }
+}
+
+void RandomForest::proximity_block_task(int block, void* arg) {
+  proximity_context* context = static_cast<proximity_context*>(arg);
+  int num_trees = context->forest->trees_.size();
+  int begin = block * kProximityBlock;
+  int end = min(begin + kProximityBlock, context->limit);
+  // #trees each instance shares a leaf with the current row
+  vector<uint32> counts(context->limit, 0);
+  vector<int> touched;
+  for (int i = begin; i < end; ++i) {
+    count_proximity_row(*context, i, &counts, &touched);
+    sort(touched.begin(), touched.end());
+    vector<pair<int, float> >& row = context->prox->rows_[i];
+    row.resize(touched.size());
+    for (int k = 0; k < touched.size(); ++k) {
+      int j = touched[k];
+      row[k] = make_pair(j, float(counts[j]) / num_trees);
+      counts[j] = 0;
+    }
+    if (context->top_k > 0) {
+      ProximityMatrix::keep_top(&row, context->top_k);
+    }
+  }
+}
+
+/**
+ * Write a block of rows of the dense matrix through a mapping of just
+ * those rows (the file starts out as zeros, so only nonzeros are stored)
+ */
+void RandomForest::proximity_file_task(int block, void* arg) {
+  proximity_context* context = static_cast<proximity_context*>(arg);
+  uint32 num_trees = context->forest->trees_.size();
+  size_t n = context->limit;
+  int begin = block * kProximityBlock;
+  int end = min(begin + kProximityBlock, context->limit);
+  size_t value_size = (context->format == PROXIMITY_UINT16) ?
+                      sizeof(uint16) : sizeof(float);
+  size_t first = sizeof(proximity_file_header) + begin * n * value_size;
+  size_t last = sizeof(proximity_file_header) + end * n * value_size;
+  // mappings start on a page boundary
+  size_t page = sysconf(_SC_PAGESIZE);
+  size_t offset = first / page * page;
+  void* map = mmap(NULL, last - offset, PROT_READ | PROT_WRITE, MAP_SHARED,
+                   context->fd, offset);
+  if (map == MAP_FAILED) {
+    context->failed = true;
+    return;
+  }
+  char* rows = static_cast<char*>(map) + (first - offset);
+  vector<uint32> counts(n, 0);
+  vector<int> touched;
+  for (int i = begin; i < end; ++i) {
+    count_proximity_row(*context, i, &counts, &touched);
+    char* row = rows + (i - begin) * n * value_size;
+    for (int k = 0; k < touched.size(); ++k) {
+      int j = touched[k];
+      if (context->format == PROXIMITY_UINT16) {
+        // rounded to the nearest 1/65535
+        reinterpret_cast<uint16*>(row)[j] =
+            uint16(counts[j] * 65535.0 / num_trees + 0.5);
+      } else {
+        reinterpret_cast<float*>(row)[j] = float(counts[j]) / num_trees;
+      }
+      counts[j] = 0;
+    }
+  }
+  munmap(map, last - offset);
+}
+
+/**
+ * Sparse proximity matrix: instances are grouped by the leaf they reach
+ * in each tree (in parallel across trees), then each row is counted from
+ * the leaves its instance is in, with a counter per block of rows (in
+ * parallel across blocks). The cost follows the number of pairs sharing
+ * a leaf instead of n^2, and rows are cut to top_k as they are made.
+ * @param limit only the first limit instances (-1: all of set)
+ * @param top_k keep the top_k largest proximities of each row (0: all)
+ * @param num_threads #threads (<= 0: all processors)
+ */
+void RandomForest::compute_proximity(const InstanceSet& set,
+                                     ProximityMatrix* prox,
+                                     int limit, int top_k,
+                                     int num_threads) const {
+  if (limit == -1) {
+    limit = set.size();
+  }
+  proximity_context context;
+  context.forest = this;
+  context.set = &set;
+  context.limit = limit;
+  context.top_k = top_k;
+  context.leaves.resize(trees_.size());
+  context.by_leaf.resize(trees_.size());
+  context.leaf_start.resize(trees_.size());
+  context.prox = prox;
+  parallel_for(trees_.size(), num_threads, proximity_tree_task, &context);
+  prox->rows_.assign(limit, vector<pair<int, float> >());
+  int num_blocks = (limit + kProximityBlock - 1) / kProximityBlock;
+  parallel_for(num_blocks, num_threads, proximity_block_task, &context);
+}
+
+/**
+ * Write the dense proximity matrix of the first limit instances to a
+ * binary file (see proximity_file_header), without holding it in memory:
+ * blocks of rows are counted as in compute_proximity and stored through
+ * a mapping of their part of the file. Pairs that never share a leaf are
+ * never written, so they cost nothing (the file is sparse on disk where
+ * the file system allows it).
+ * @param format PROXIMITY_FLOAT (float32) or PROXIMITY_UINT16
+ *               (proximity * 65535, rounded)
+ * @return false if the file could not be written
+ */
+bool RandomForest::write_proximity(const InstanceSet& set,
+                                   const string& filename,
+                                   int limit, int format,
+                                   int num_threads) const {
+  if (limit == -1) {
+    limit = set.size();
+  }
+  int fd = open(filename.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0) {
+    cerr << "Could not open " << filename << endl;
+    return false;
+  }
+  proximity_file_header header;
+  memcpy(header.magic, kProximityMagic, sizeof(header.magic));
+  header.version = 1;
+  header.num_instances = limit;
+  header.format = format;
+  size_t value_size = (format == PROXIMITY_UINT16) ? sizeof(uint16)
+                                                   : sizeof(float);
+  size_t size = sizeof(header) + size_t(limit) * limit * value_size;
+  if (::write(fd, &header, sizeof(header)) != sizeof(header) ||
+      ftruncate(fd, size) != 0) {
+    cerr << "Could not write " << filename << endl;
+    close(fd);
+    return false;
+  }
+  proximity_context context;
+  context.forest = this;
+  context.set = &set;
+  context.limit = limit;
+  context.leaves.resize(trees_.size());
+  context.by_leaf.resize(trees_.size());
+  context.leaf_start.resize(trees_.size());
+  context.fd = fd;
+  context.format = format;
+  context.failed = false;
+  parallel_for(trees_.size(), num_threads, proximity_tree_task, &context);
+  int num_blocks = (limit + kProximityBlock - 1) / kProximityBlock;
+  parallel_for(num_blocks, num_threads, proximity_file_task, &context);
+  close(fd);
+  if (context.failed) {
+    cerr << "Could not map " << filename << endl;
+  }
+  return !context.failed;
+}
+
+/**
+ * Outlier scores from a sparse proximity matrix
+ * (same scores as from the dense matrix: missing entries are 0)
+ */
+void RandomForest::compute_outliers(const InstanceSet& set, int label,
+                                    const ProximityMatrix& prox,
+                                    vector< pair< float, int> >*ranking) const {
+  for (int i = 0; i < prox.size(); ++i) {
+    if (set.label(i) != label) {
+      continue;
+    }
+    float average_proximity = 0;
+    const vector<pair<int, float> >& row = prox.row(i);
+    for (int k = 0; k < row.size(); ++k) {
+      if (set.label(row[k].first) == label) {
+        average_proximity += row[k].second * row[k].second;
+      }
+    }
+    float out_score = float(set.size()) / average_proximity;
+    ranking->push_back(make_pair(out_score, i));
+  }
+  sort(ranking->begin(), ranking->end(), greater<pair<float,int> >());
+}
+
 void RandomForest::compute_outliers(const InstanceSet& set, int label,
                                    const vector<vector<float> >& mat,
                                    vector< pair< float, int> >*ranking) const {
@@ -194,19 +838,39 @@ void RandomForest::compute_outliers(const InstanceSet& set, int label,
 
 
 
+/**
+ * Fraction of the OOB votes of a training instance that went to label
+ * (0 if the instance was in the bag of every tree)
+ */
 float RandomForest::oob_predict_prob(int instance_no,
                                      int label) const {
-   // Gather the votes from each tree
-  DiscreteDist votes;
+  int total = oob_vote_total(instance_no);
+  if (total == 0 || label >= num_labels_) {
+    return 0;
+  }
+  return float(oob_votes_[instance_no * num_labels_ + label]) / total;
+}
+
+int RandomForest::oob_vote_total(int instance_no) const {
+  const uint16* votes = &oob_votes_[instance_no * num_labels_];
   int total = 0;
-  for (int i = 0; i < trees_.size(); ++i) {
-    if (trees_[i]->oob(instance_no)) {
-      int predict = trees_[i]->predict(set_, instance_no);
-      votes.add(predict);
-      total++;
+  for (int i = 0; i < num_labels_; ++i) {
+    total += votes[i];
+  }
+  return total;
+}
+
+// Label with the most OOB votes (ties and no votes: the smaller label,
+// as in DiscreteDist::mode)
+int RandomForest::oob_mode(int instance_no) const {
+  const uint16* votes = &oob_votes_[instance_no * num_labels_];
+  int mode = 0;
+  for (int i = 1; i < num_labels_; ++i) {
+    if (votes[i] > votes[mode]) {
+      mode = i;
     }
   }
-  return votes.percentage(label);
+  return mode;
 }
 
 int RandomForest::oob_predict(int instance_no,
@@ -239,19 +903,21 @@ float RandomForest::predict_prob(const InstanceSet& set, int instance_no, int la
 
 
 void RandomForest::oob_predictions(vector<DiscreteDist>* predicts) const{
-  predicts->resize(set_.size(),DiscreteDist(2));
-  for (int i = 0; i < trees_.size(); ++i) {
-    trees_[i]->oob_predictions(predicts);
+  predicts->resize(set_.size(), DiscreteDist(num_labels_));
+  for (int i = 0; i < set_.size(); ++i) {
+    for (int j = 0; j < num_labels_; ++j) {
+      if (oob_votes_[i * num_labels_ + j] > 0) {
+        (*predicts)[i].add(j, oob_votes_[i * num_labels_ + j]);
+      }
+    }
   }
 }
 
 
 float RandomForest::oob_accuracy() const {
-  vector<DiscreteDist> predicts;
-  oob_predictions(&predicts);
   int total = 0;
   for (int i = 0; i < set_.size(); ++i) {
-    if (predicts[i].mode() == set_.label(i)) {
+    if (oob_mode(i) == set_.label(i)) {
       total++;
     }
   }
@@ -260,11 +926,13 @@ float RandomForest::oob_accuracy() const {
 
 
 void RandomForest::test_confusion(const InstanceSet& set) const {
-  vector<int> predictions;
+  vector<int> predictions(set.size());
   vector<int> labels;
+  if (set.size() > 0) {
+    predict_batch(set, 0, set.size(), &predictions[0]);
+  }
   for (int i = 0; i < set.size(); ++i) {
     labels.push_back(set.label(i));
-    predictions.push_back(predict(set, i));
   }
   // HARDCODED
   // TODO: Fix me!
@@ -298,12 +966,10 @@ void RandomForest::confusion_matrix(int num_labels,
 
 
 void RandomForest::oob_confusion() const {
-  vector<DiscreteDist> predicts;
-  oob_predictions(&predicts);
   vector<int> prediction;
   vector<int> labels;
-  for (int i = 0; i < predicts.size(); ++i) {
-    prediction.push_back(predicts[i].mode());
+  for (int i = 0; i < set_.size(); ++i) {
+    prediction.push_back(oob_mode(i));
     labels.push_back(set_.label(i));
   }
   //HARDCODED
@@ -331,10 +997,15 @@ float RandomForest::training_accuracy() const {
   return float(correct) / set_.size();
 }
 
-float RandomForest::testing_accuracy(const InstanceSet& set) const {
+float RandomForest::testing_accuracy(const InstanceSet& set,
+                                     int num_threads) const {
+  vector<int> predictions(set.size());
+  if (set.size() > 0) {
+    predict_batch(set, 0, set.size(), &predictions[0], num_threads);
+  }
   int correct = 0;
   for (int i = 0; i < set.size(); ++i) {
-    if (predict(set, i) == set.label(i))
+    if (predictions[i] == set.label(i))
       correct++;
   }
   return float(correct) / set.size();
@@ -342,19 +1013,62 @@ float RandomForest::testing_accuracy(const InstanceSet& set) const {
 
 
 
+void RandomForest::importance_tree_task(int tree_no, void* arg) {
+  importance_context* context = static_cast<importance_context*>(arg);
+  const Tree* tree = context->forest->trees_[tree_no];
+  const InstanceSet& set = context->forest->set_;
+  vector<int> rows;
+  tree->oob_instances(&rows);
+  context->correct[tree_no] = tree->num_correct(RowView(set, rows));
+}
+
+void RandomForest::importance_pair_task(int pair_no, void* arg) {
+  importance_context* context = static_cast<importance_context*>(arg);
+  int tree_no = context->pairs[pair_no].first;
+  int var = context->pairs[pair_no].second;
+  const Tree* tree = context->forest->trees_[tree_no];
+  const InstanceSet& set = context->forest->set_;
+  // the view is rebuilt per pair (cheaper than predicting it) rather
+  // than kept for every tree, and shuffled with the pair's own stream
+  vector<int> oob;
+  tree->oob_instances(&oob);
+  RowView rows(set, oob);
+  Random rng = Random(context->seed, tree_no).stream(var);
+  rows.permute(var, &rng);
+  context->scores[pair_no] = context->correct[tree_no] -
+                             tree->num_correct(rows);
+}
+
+/**
+ * Permutation importance: the drop in OOB accuracy of every tree when
+ * a variable it uses is shuffled among its OOB instances.
+ * The (tree, variable) pairs are scored in parallel; each pair draws its
+ * shuffle from a stream of its own, so the result only depends on seed.
+ * @param num_threads #threads (<= 0: all processors)
+ */
 void RandomForest::variable_importance(vector< pair< float, int> >*ranking,
-                                       unsigned int* seed) const {
-  vector<float> importances(set_.num_attributes(),
-                            0.00);
-  // Zero-out importances
+                                       unsigned int* seed,
+                                       int num_threads) const {
+  importance_context context;
+  context.forest = this;
+  context.correct.resize(trees_.size());
+  context.seed = rand_r(seed);
+  parallel_for(trees_.size(), num_threads, importance_tree_task, &context);
   for (int i = 0; i < trees_.size(); ++i) {
-    vector<float> tree_importance;
-    trees_[i]->variable_importance(&tree_importance, seed);
-    //aggregate
-    for (int j = 0; j < tree_importance.size(); ++j) {
-      importances[j] +=  tree_importance[j];
+    for (int j = 0; j < set_.num_attributes(); ++j) {
+      if (trees_[i]->uses_var(j)) {
+        context.pairs.push_back(make_pair(i, j));
+      }
     }
   }
+  context.scores.resize(context.pairs.size());
+  parallel_for(context.pairs.size(), num_threads, importance_pair_task,
+               &context);
+  // aggregate (in a fixed order)
+  vector<float> importances(set_.num_attributes(), 0.00);
+  for (int i = 0; i < context.pairs.size(); ++i) {
+    importances[context.pairs[i].second] += context.scores[i];
+  }
   // Get the mean of scores
   vector<float> raw_scores;
   float sum = 0;
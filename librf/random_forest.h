@@ -7,6 +7,9 @@
 #define _RANDOM_FOREST_H_
 
 #include <vector>
+#include "librf/types.h"
+#include "librf/random.h"
+#include "librf/proximity.h"
 
 using namespace std;
 
@@ -14,6 +17,26 @@ namespace librf {
 class DiscreteDist;
 class InstanceSet;
 class Tree;
+struct grow_context;
+struct predict_context;
+struct importance_context;
+struct proximity_context;
+
+/// Which instances a bag is drawn from
+typedef enum {
+  BAG_RANDOM,      // the whole training set
+  BAG_STRATIFIED,  // each label in proportion to its share of the set
+  BAG_BALANCED     // the same number of instances of every label
+} BagSamplingType;
+
+/// How the bag of each tree is drawn (default: the bootstrap)
+struct bag_options {
+  bag_options() : fraction(1.0), replacement(true), sampling(BAG_RANDOM) {}
+  float fraction;            // bag size as a fraction of the training set
+  bool replacement;          // with replacement, or subbagging without
+  BagSamplingType sampling;
+};
+
 /**
  * @brief
  * RandomForest class.  Interface for growing random forests from training
@@ -27,7 +50,11 @@ class RandomForest {
     RandomForest(const InstanceSet& set,
                  int num_trees,
                  int K,
-                 const vector<int>& weights = vector<int>());
+                 const vector<float>& weights = vector<float>(),
+                 int num_threads = 1,
+                 unsigned int seed = 1,
+                 SplitCriterionType criterion = ENTROPY,
+                 const bag_options& bagging = bag_options());
     ~RandomForest();
      /// Method to predict the label
      // int predict(const Instance& c) const;
@@ -43,8 +70,30 @@ class RandomForest {
                             int label) const;
      /// Predict probability of given label
      float predict_prob(const InstanceSet& set, int instance_no, int label) const;
+     /// Predict the labels of instances [begin, end) into out[0..end-begin)
+     void predict_batch(const InstanceSet& set, int begin, int end,
+                        int* out, int num_threads = 1) const;
+     /// Predict probabilities of given label for instances [begin, end)
+     void predict_prob_batch(const InstanceSet& set, int begin, int end,
+                             int label, float* out,
+                             int num_threads = 1) const;
+     /// Predict the label of a raw feature vector
+     int predict(const float* features, int num_features) const;
+     /// Predict probability of given label for a raw feature vector
+     float predict_prob(const float* features, int num_features,
+                        int label) const;
+     /// Predict the labels of row-major feature vectors
+     void predict_batch(const float* rows, size_t num_rows,
+                        int num_features, size_t stride, int* out,
+                        int num_threads = 1) const;
+     /// Predict probabilities of given label for row-major feature vectors
+     void predict_prob_batch(const float* rows, size_t num_rows,
+                             int num_features, size_t stride,
+                             int label, float* out,
+                             int num_threads = 1) const;
      /// Returns test accuracy of a labeled test set
-     float testing_accuracy(const InstanceSet& testset) const;
+     float testing_accuracy(const InstanceSet& testset,
+                            int num_threads = 1) const;
      /// Returns training accuracy 
      float training_accuracy() const;
      void oob_votes(const InstanceSet& set, int instance_no,
@@ -55,11 +104,21 @@ class RandomForest {
                            const vector<int>&) const;
      /// Returns OOB accuracy (unbiased estimate of test accuracy)
      float oob_accuracy() const;
+     /// #trees for which an instance was out of bag (its OOB votes)
+     int oob_vote_total(int instance_no) const;
      void oob_confusion() const;
      void test_confusion(const InstanceSet& set) const;
+     /// Mean decrease in impurity of every variable (per instance, averaged
+     /// over the trees). Free after training, and saved with the model
+     /// (empty for models saved without it)
+     const vector<float>& impurity_importance() const {
+       return impurity_importance_;
+     }
      /// Variable importance ranking of features
+     /// (the ranking depends on the seed, not on num_threads)
      void variable_importance(vector< pair<float, int> >* ranking,
-                              unsigned int* seed) const;
+                              unsigned int* seed,
+                              int num_threads = 1) const;
      void variable_importance2(vector< pair<float, int> >* ranking,
                               unsigned int* seed) const;
 
@@ -72,30 +131,95 @@ class RandomForest {
                               vector<pair<float, float> >*,
                               vector<int>*,
                               int label = 1) const;
+     /// Reliability diagram of given probabilities of label
+     /// (probs[i]: instance i of set), ex. from another predictor
+     static void reliability_diagram(const InstanceSet& set,
+                                     const vector<float>& probs,
+                                     int bins,
+                                     vector<pair<float, float> >*,
+                                     vector<int>*,
+                                     int label = 1);
      void compute_proximity(const InstanceSet& set,
                             vector<vector<float> >* prox,
                             int limit = -1) const;
+     /// Sparse proximities of the first limit instances (-1: all),
+     /// only the top_k largest of each row if top_k > 0
+     void compute_proximity(const InstanceSet& set,
+                            ProximityMatrix* prox,
+                            int limit = -1, int top_k = 0,
+                            int num_threads = 1) const;
     void compute_skewed_proximity(const InstanceSet& set,
                             vector<vector<float> >* prox,
                             int limit = -1) const;
 
 
+     /// Dense proximities written to a binary file, a block of rows at
+     /// a time (format: PROXIMITY_FLOAT or PROXIMITY_UINT16)
+     bool write_proximity(const InstanceSet& set, const string& filename,
+                          int limit = -1, int format = PROXIMITY_FLOAT,
+                          int num_threads = 1) const;
      void compute_outliers(const InstanceSet& set, int label,
                            const vector<vector<float> >& mat,
                            vector<pair< float, int> >* ranking) const;
+     void compute_outliers(const InstanceSet& set, int label,
+                           const ProximityMatrix& prox,
+                           vector<pair< float, int> >* ranking) const;
      /// Load random forest
      void read(istream& i);
      /// Save random forest
      void write(ostream& o);
      /// Debug output
      void print() const;
+     /// Number of trees in the forest
+     int num_trees() const {
+       return trees_.size();
+     }
+     /// Number of random vars tried per split
+     int K() const {
+       return K_;
+     }
+     /// Tree access
+     const Tree& tree(int i) const {
+       return *trees_[i];
+     }
+     /// Text form of the importance section of a model
+     static void write_importance(ostream& o,
+                                  const vector<float>& importance);
+     static void read_importance(istream& in, vector<float>* importance);
+     /// Most trees a forest can grow (OOB vote counts are uint16)
+     static const int kMaxTrees;
   private:
+    void grow_tree(int tree_no, const grow_context& context);
+    static void grow_tree_task(int tree_no, void* arg);
+    int vote(const float* features, int num_features,
+             unsigned int* votes) const;
+    void vote_block(const predict_context& c, int begin, int end,
+                    vector<DiscreteDist>* votes) const;
+    static void predict_block_task(int block, void* arg);
+    static void importance_tree_task(int tree_no, void* arg);
+    static void importance_pair_task(int pair_no, void* arg);
+    static void proximity_tree_task(int tree_no, void* arg);
+    static void proximity_block_task(int block, void* arg);
+    static void proximity_file_task(int block, void* arg);
+    void predict_rows(predict_context* context, int num_threads) const;
+    int oob_mode(int instance_no) const;
+    void nlogn_table(const bag_options& bagging,
+                     vector<double>* table) const;
+    static const int kPredictBlock; // rows per block in batch prediction
+    static const double kMaxTableWeight; // (see nlogn_table)
+    static const int kProximityBlock; // rows per proximity task
     const InstanceSet& set_;  // training data set
     vector<Tree*> trees_;     // component trees in the forest
     // int max_depth_;           // maximum depth of trees (DEPRECATED)
     int K_;                   // random vars to try per split
+    SplitCriterionType criterion_; // impurity measure for splits
     vector< pair<float, int> > var_ranking_; // cached var_ranking
-    vector<int> class_weights_;
+    vector<float> class_weights_;
+    vector<float> impurity_importance_; // mean decrease in impurity
+    // OOB votes of each training instance for each label (#labels per
+    // instance), recorded as the trees are grown
+    vector<uint16> oob_votes_;
+    int num_labels_;
 };
 
 } // namespace
@@ -12,7 +12,7 @@
 #include "librf/instance_set.h"
 #include "librf/discrete_dist.h"
 #include "librf/weights.h"
-#include "librf/utils.h"
+#include "librf/tree_builder.h"
 #include <float.h>
 #include <deque>
 #include <set>
@@ -28,11 +28,9 @@ const int Tree::kRight = 1;
 Tree::Tree(istream& in):
               // if we load the tree from disk, there is no training data set
               set_(InstanceSet()),
+              binned_(false),
               // also there is no list of weights
-              weight_list_(NULL),
-              sorted_inum_(NULL),
-              temp(NULL),
-              move_left(NULL)
+              weight_list_(NULL)
 {
   read(in);
 }
@@ -44,62 +42,62 @@ Tree::Tree(istream& in):
  * @param min_size minimum number of instances in a node
  * @param min_gain minimum information gain for making a split
  * @param seed random seed
+ * @param criterion impurity measure (entropy or gini)
+ * @param class_weights weight of each label (missing ones are 1)
+ *
+ * Every draw of an instance into the bag counts with its
+ * instance_weight, in the split gains and in the leaf labels.
  */
 Tree::Tree(const InstanceSet& set,
            weight_list* weights,
            int K,
            int min_size,
            float min_gain,
-           unsigned int seed
+           uint64 seed,
+           SplitCriterionType criterion,
+           const vector<float>& class_weights
            ) :
+                             impurity_decrease_(set.num_attributes(), 0),
+                             terminal_nodes_(0), split_nodes_(0),
                              set_(set),
+                             binned_(set.binned()),
                              weight_list_(weights),
+                             class_weights_(class_weights),
                              K_(K),
                              min_size_(min_size),
                              min_gain_(min_gain),
-                             num_attributes_(set.num_attributes()),
-                             num_instances_(set.size()),
+                             criterion_(criterion),
                              // stride_(set.size()),
-                             split_nodes_(0), terminal_nodes_(0),
-                             rand_seed_(seed)
+                             num_instances_(set.size()),
+                             num_attributes_(set.num_attributes()),
+                             rng_(seed)
 {
 }
-/***
- * Copy the sorted indices from the training set
- * into our special matrix (sorted_inum)
- */
-void Tree::copy_instances() {
-  sorted_inum_ = new uint16*[num_attributes_];
-  for (int i = 0; i <num_attributes_; ++i) {
-    const vector<int>& sorted = set_.get_sorted_indices(i);
-    sorted_inum_[i] = new uint16[num_instances_];
-    for (int j = 0; j < num_instances_; ++j) {
-      sorted_inum_[i][j] = sorted[j];
-    }
-  }
-  temp = new int[num_instances_];
-  move_left = new uchar[num_instances_];
-}
-
-
 /**
  * Do the work of growing the tree
- * - Copy the data into special matrix
- * - Build the tree
- * - Delete special matrix
+ * The index width of the working matrix depends on the
+ * number of distinct instances in the bag (see TreeBuilder)
  */
-void Tree::grow() {
-  copy_instances();
-  build_tree(min_size_);
-  // delete sorted_inum
-  if (sorted_inum_ != NULL) {
-    for (int i = 0; i <num_attributes_; ++i) {
-      delete [] sorted_inum_[i];
+void Tree::grow(const vector<double>* nlogn) {
+  uint32 bag_size = weight_list_->num_nonzero();
+  if (bag_size <= 65536) {
+    TreeBuilder<uint16> builder(this, nlogn);
+    builder.build();
+  } else {
+    TreeBuilder<uint32> builder(this, nlogn);
+    builder.build();
+  }
+  // weighted decreases -> per unit of weight in the bag
+  double total = 0;
+  for (weight_list::const_iterator it = weight_list_->begin(); !it.done();
+       ++it) {
+    total += it.weight() * instance_weight(it.instance());
+  }
+  if (total > 0) {
+    for (int i = 0; i < impurity_decrease_.size(); ++i) {
+      impurity_decrease_[i] /= total;
     }
-    delete [] sorted_inum_;
   }
-  delete [] temp;
-  delete [] move_left;
 }
 
 
@@ -140,22 +138,12 @@ void Tree::read(istream& in) {
 }
 
 
-void Tree::build_tree(int min_size) {
-  int built_nodes = 0;
-  // set up ROOT NODE (constains all instances)
-  add_node(0, num_instances_, 0);
-  do {
-    build_node(built_nodes, min_size_);
-    built_nodes++;
-  } while (built_nodes < nodes_.size());
-}
-
 void Tree::mark_terminal(tree_node* n) {
   n->status = TERMINAL;
   terminal_nodes_++;
 }
 
-void Tree::mark_split(tree_node* n, uint16 split_attr, float split_point) {
+void Tree::mark_split(tree_node* n, uint32 split_attr, float split_point) {
   n->status = SPLIT;
   n->attr = split_attr;
   n->split_point = split_point;
@@ -166,7 +154,7 @@ void Tree::mark_split(tree_node* n, uint16 split_attr, float split_point) {
 }
 
 
-void Tree::add_node(uint16 start, uint16 size, uchar depth) {
+void Tree::add_node(uint32 start, uint32 size, uchar depth) {
   tree_node n;
   n.status = BUILD_ME;
   n.start = start;
@@ -175,257 +163,6 @@ void Tree::add_node(uint16 start, uint16 size, uchar depth) {
   nodes_.push_back(n);
 }
 
-void Tree::build_node(uint16 node_num, uint16 min_size) {
-  // cout << "building node " << node_num <<endl;
-  uint16 nodes_created = 0;
-  assert(node_num < nodes_.size());
-  tree_node* n = &nodes_[node_num];
-  // Calculate starting entropy
-  DiscreteDist d;
-  uint16 nstart = n->start;
-  uint16 nend = n->start + n->size;
-  for (uint16 i = n->start; i < nend; ++i) {
-    uint16 instance = sorted_inum_[0][i];
-    d.add(set_.label(instance), (*weight_list_)[instance]);
-  }
-  n->entropy = d.entropy_over_classes();
-  // cout << "entropy: " << n-> entropy << endl;
-  n->label = d.mode();
-
-  // Min_size or completely pure check
-  if (n->size <= min_size || n->entropy == 0) { //|| n->depth >= (max_depth_ -1)) {
-    mark_terminal(n);
-    /* if (n->size <= min_size) {
-       cout << "terminal due to size of " << n->size << endl;
-    } else if (n->entropy==0) {
-      cout << "terminal due to zero entropy" << endl;
-    } else  {
-      cout << "terminal due to depth: " << int(n->depth) << endl;
-    }*/
-    return;
-  }
-
-  int split_attr, split_idx;
-  float split_point, split_gain;
-  vector<int> attrs;
-  random_sample(num_attributes_, K_, &attrs, &rand_seed_);
-  find_best_split(n, attrs, &split_attr, &split_idx, &split_point, &split_gain);
-  if (split_gain > min_gain_) {
-    mark_split(n, split_attr, split_point);
-    move_data(n, split_attr, split_idx);
-    uint16 left_size = split_idx - n->start + 1;
-    uint16 right_size = n->size - left_size;
-    add_node(n->start, left_size, n->depth + 1);
-    add_node(split_idx + 1, right_size, n->depth + 1);
-   } else {
-    // cout << "couldn't find a split" << endl;
-    mark_terminal(n);
-   }
-}
-
-void Tree::move_data(tree_node* n, uint16 split_attr, uint16 split_idx) {
-// PRE-CONDITION
-// the same number of distinct case numbers are found in
-// sorted_inum_[m][nstart-nend] for all m
-
-// Step 1:
-// Create an indicator bit set for moving left
-// ex. move_left[instance number]
-  // vector<uchar> move_left(set_.size(), 0);
-  uint16 nstart = n->start;
-  uint16 nend = nstart + n->size;
-  for (int i =0; i < num_instances_; ++i) {
-    move_left[i] = 0;
-  }
-  // int split_stride = split_attr * stride_;
-  for (uint16 i = nstart; i <=split_idx; ++i) {
-    //int instance_num = sorted_inum_[split_stride + i];
-    int instance_num = sorted_inum_[split_attr][i];
-    move_left[instance_num] = 1;
-  }
-
-// Step 2:
-// For every attribute
-//    fill a temporary vector -- move left | move right
-//    write this back to the sorted_inum_
-  // vector<int> temp(n->size);
-  for (int attr = 0; attr < num_attributes_; ++attr) {
-    int left = n->start;
-    int right = split_idx + 1;
-    // int attr_stride = attr * stride_;
-    // Move instance numbers Left and right
-    for (uint16 i = nstart; i < nend; ++i) {
-      // int instance_num = sorted_inum_[attr_stride + i];
-       int instance_num = sorted_inum_[attr][i];
-      //cout << i << " ";
-      //cout << instance_num << " ";
-      //cout << int(move_left[instance_num]) << endl;
-      if (move_left[instance_num]) {
-        assert(left < num_instances_);
-        temp[left++] = instance_num;
-      } else {
-        assert(right < num_instances_);
-        temp[right++] = instance_num;
-      }
-    }
-    // Write temp back to sorted_inum
-    for (uint16 i = nstart; i < nend; ++i) {
-      //sorted_inum_[attr_stride + i] = temp[i];
-      sorted_inum_[attr][i] = temp[i];
-    }
-   }
-// POST-CONDITION
-// sorted_instances_[m][nstart-split] are consistent
-// sorted_instances_[m][split-nend] are consistent
-}
-void Tree::find_best_split(tree_node* n, const vector<int>& attrs,
-                           int* split_attr, int* split_idx,
-                           float* split_point, float* split_gain) {
-  float best_gain = -DBL_MAX;
-	int best_attr = -1;
-  int best_split_idx = -1;
-	float best_split_point = -DBL_MAX;
-	for (int i = 0; i < attrs.size(); ++i) {
-    int attr =attrs[i];
-    // cout << "investigating attr #" << attr <<endl;
-		int curr_split_idx = -999;
-    float curr_split_point = -999;
-		float curr_gain = -DBL_MAX;
-		find_best_split_for_attr(n, attr, n->entropy, &curr_split_idx,
-                             &curr_split_point, &curr_gain);
-    // cout << attr << ":" << curr_split_point << "->" << curr_gain <<endl;
-		if (curr_gain > best_gain) {
-				best_gain = curr_gain;
-				best_split_idx = curr_split_idx;
-        best_split_point = curr_split_point;
-				best_attr = attr;
-        assert(best_split_idx >=0);
-        assert(best_split_idx < num_instances_);
-		}
-	}
-  // get the split point
-	*split_point = best_split_point;
-	*split_attr = best_attr;
-  *split_idx = best_split_idx;
-	*split_gain = best_gain;
-}
-
-
-
-/*
-void Tree::find_best_split_for_attr_gini(tree_node* n,
-                                    int attr,
-                                    float prior_entropy,
-                                    int* split_idx,
-                                    float* split_point,
-                                    float* best_gain) {
-  int nstart = n->start;
-  int nend = n->start + n->size;
-  DiscreteDist split_dist[2];
-  // int attr_stride = attr * stride_;
-  // Move all the instances into the right split at first
-  for (int i = nstart; i < nend; ++i) {
-    //int inst_no = sorted_inum_[attr_stride + i];
-    int inst_no = sorted_inum_[attr][i];
-    split_dist[kRight].add(set_.label(inst_no),
-                           (*weight_list_)[inst_no]);
-  }
-  //cout << "Right Dist: " << endl;
-  // split_dist[kRight].print();
-  // cout << "debug sorted_inum" << endl;
-  //for (int i = nstart; i < nend; ++i) {
-  //  cout << int(set_.label(sorted_inum_[attr][i])) << endl;
-  //}
-  // set up initial values
-  *best_gain = -DBL_MAX;
-  //int next = sorted_inum_[attr_stride + nstart];
-  int next = sorted_inum_[attr][nstart];
-  float next_value = set_.get_attribute(next, attr);
-  // Look for splits
-  for (int i = nstart; i < nend - 1; ++i) {
-    int cur = next;
-    //next = sorted_inum_[attr_stride +  i + 1];
-    next = sorted_inum_[attr][ i + 1];
-    // cout << "cur is : " << cur <<endl;
-    int label = int(set_.label(cur));
-    int weight = (*weight_list_)[cur];
-    // cout << "moving " << label << " weight " << weight << endl;
-    split_dist[kRight].remove(label, weight);
-    split_dist[kLeft].add(label, weight);
-    float cur_value =  next_value;
-    next_value = set_.get_attribute(next, attr);
-    if (cur_value < next_value) {
-      // Calculate gain (can be sped up with incremental calculation!
-      float split_entropy = DiscreteDist::entropy_conditioned(split_dist, 2);
-      float curr_gain = prior_entropy - split_entropy;
-      // cout << "split point: " << (cur_value + next_value)/2.0 << " gain: " << curr_gain << endl;
-      if (curr_gain > *best_gain) {
-        *best_gain = curr_gain;
-        *split_idx = i;
-        *split_point = (cur_value + next_value)/2.0;
-      }
-    }
-  }
-}
-*/
-
-void Tree::find_best_split_for_attr(tree_node* n,
-                                    int attr,
-                                    float prior_entropy,
-                                    int* split_idx,
-                                    float* split_point,
-                                    float* best_gain) {
-  int nstart = n->start;
-  int nend = n->start + n->size;
-  DiscreteDist split_dist[2];
-  // int attr_stride = attr * stride_;
-  // Move all the instances into the right split at first
-  for (int i = nstart; i < nend; ++i) {
-    //int inst_no = sorted_inum_[attr_stride + i];
-    int inst_no = sorted_inum_[attr][i];
-    split_dist[kRight].add(set_.label(inst_no),
-                           (*weight_list_)[inst_no]);
-  }
-  //cout << "Right Dist: " << endl;
-  // split_dist[kRight].print();
-  // cout << "debug sorted_inum" << endl;
-  //for (int i = nstart; i < nend; ++i) {
-  //  cout << int(set_.label(sorted_inum_[attr][i])) << endl;
-  //}
-  // set up initial values
-  *best_gain = -DBL_MAX;
-  //int next = sorted_inum_[attr_stride + nstart];
-  int next = sorted_inum_[attr][nstart];
-  float next_value = set_.get_attribute(next, attr);
-  //uint16 next_value = set_.get_rank(next, attr);
-  // Look for splits
-  for (int i = nstart; i < nend - 1; ++i) {
-    int cur = next;
-    //next = sorted_inum_[attr_stride +  i + 1];
-    next = sorted_inum_[attr][ i + 1];
-    // cout << "cur is : " << cur <<endl;
-    int label = int(set_.label(cur));
-    int weight = (*weight_list_)[cur];
-    // cout << "moving " << label << " weight " << weight << endl;
-    split_dist[kRight].remove(label, weight);
-    split_dist[kLeft].add(label, weight);
-    float cur_value =  next_value;
-    //uint16 cur_value =  next_value;
-    next_value = set_.get_attribute(next, attr);
-    // next_value = set_.get_rank(next, attr);
-    if (cur_value < next_value) {
-      // Calculate gain (can be sped up with incremental calculation!
-      float split_entropy = DiscreteDist::entropy_conditioned(split_dist, 2);
-      float curr_gain = prior_entropy - split_entropy;
-      // cout << "split point: " << (cur_value + next_value)/2.0 << " gain: " << curr_gain << endl;
-      if (curr_gain > *best_gain) {
-        *best_gain = curr_gain;
-        *split_idx = i;
-        *split_point = (cur_value + next_value)/2.0;
-      }
-    }
-  }
-}
 /*
 void Tree::write_dot(ostream& out) {
   // if root node 
@@ -478,6 +215,46 @@ int Tree::predict(const InstanceSet& set, int instance_no, int *terminal) const
   return label;
 }
 
+/**
+ * Predict a row of a RowView (the view may have a permuted attribute)
+ */
+int Tree::predict(const RowView& rows, int i) const {
+  int cur_node = 0;
+  while (true) {
+    const tree_node* n = &nodes_[cur_node];
+    assert(n->status == TERMINAL || n->status == SPLIT);
+    if (n->status == TERMINAL) {
+      return n->label;
+    }
+    if (rows.get_attribute(i, n->attr) < n->split_point) {
+      cur_node = n->left;
+    } else {
+      cur_node = n->right;
+    }
+  }
+}
+
+/**
+ * Predict a single instance given as a plain array of attribute values
+ * (no InstanceSet needed)
+ */
+int Tree::predict(const float* features, int num_features) const {
+  int cur_node = 0;
+  while (true) {
+    const tree_node* n = &nodes_[cur_node];
+    assert(n->status == TERMINAL || n->status == SPLIT);
+    if (n->status == TERMINAL) {
+      return n->label;
+    }
+    assert(n->attr < num_features);
+    if (features[n->attr] < n->split_point) {
+      cur_node = n->left;
+    } else {
+      cur_node = n->right;
+    }
+  }
+}
+
 int Tree::predict_skew(const InstanceSet& set, int instance_no, float* skew,
                        int* terminal) const {
   //base case
@@ -547,24 +324,20 @@ int Tree::predict(const InstanceSet& set, int instance_no,
 
 float Tree::oob_accuracy () const{
   int correct = 0;
-  int total = 0;
-  // Loop through training set looking for instances with weight 0
-  for (int i =0; i < num_instances_; ++i) {
-    if ((*weight_list_)[i] ==0) {
-      if (predict(set_, i) == set_.label(i))
-        correct++;
-      total++;
-    }
+  vector<int> oob;
+  oob_instances(&oob);
+  for (int j = 0; j < oob.size(); ++j) {
+    if (predict(set_, oob[j]) == set_.label(oob[j]))
+      correct++;
   }
-  return float(correct) / total;
+  return float(correct) / oob.size();
 }
 
 void Tree::oob_predictions(vector<DiscreteDist>* predicts) const{
-  // Loop through training set looking for instances with weight 0
-  for (int i =0; i < num_instances_; ++i) {
-    if ((*weight_list_)[i] ==0) {
-      (*predicts)[i].add(predict(set_,i));
-    }
+  vector<int> oob;
+  oob_instances(&oob);
+  for (int j = 0; j < oob.size(); ++j) {
+    (*predicts)[oob[j]].add(predict(set_, oob[j]));
   }
 }
 
@@ -591,12 +364,7 @@ void Tree::print() const {
   int cur_node = 0;
   print_node(cur_node);
   cout << "Training acc: " << training_accuracy() << endl;
-  int nonzero = 0;
-  for (int i = 0; i < set_.size(); ++i) {
-    if ((*weight_list_)[i] != 0)
-        nonzero++;
-  }
-  cout << "nonzero instances: " << nonzero << endl;
+  cout << "nonzero instances: " << weight_list_->num_nonzero() << endl;
 }
 
 void Tree::print_node(int n) const{
@@ -609,44 +377,137 @@ void Tree::print_node(int n) const{
 //generate scores for all variables
 void Tree::variable_importance(vector<float>* score,
                                 unsigned int* seed) const{
-  // build subset
-  InstanceSet* subset = InstanceSet::create_subset(set_, *weight_list_);
+  // view of the OOB instances (nothing is copied)
+  RowView oob_rows(set_, *weight_list_);
+  Random rng(rand_r(seed));
   // get the oob accuracy before we start
+  int correct = num_correct(oob_rows);
+  score->resize(set_.num_attributes());
+  for (int i = 0; i < set_.num_attributes(); ++i) {
+    if (uses_var(i)) {
+      // shuffle the values in this variable around (in the view only)
+      oob_rows.permute(i, &rng);
+      // decrease in accuracy!
+      (*score)[i] = (correct - num_correct(oob_rows));
+      oob_rows.restore();
+    } else {
+      (*score)[i] = 0.0;
+    }
+  }
+}
+int Tree::num_correct(const RowView& rows) const {
   int correct = 0;
-  for (int i = 0; i < subset->size(); ++i) {
-    if (predict(*subset,i) == subset->label(i)) {
+  for (int i = 0; i < rows.size(); ++i) {
+    if (predict(rows, i) == rows.label(i)) {
       correct++;
     }
   }
-  float oob_acc = oob_accuracy();
-  score->resize(set_.num_attributes());
-  for (int i = 0; i < set_.num_attributes(); ++i) {
-    if (vars_used_.find(i) != vars_used_.end()) {
-      // make a backup copy of the variable 
-      vector<float> backup;
-      subset->save_var(i, &backup);
-      // shuffle the values in this variable around
-      subset->permute(i, seed);
-      int permuted = 0;
-      for (int j = 0; j < subset->size(); ++j) {
-        if (predict(*subset,j) == subset->label(j)) {
-          permuted++;
+  return correct;
+}
+
+/**
+ * Grow an isolation tree from the instances of the weight list (the
+ * sample): each node splits on a random attribute at a random point
+ * between the node's smallest and largest value, until the node holds
+ * a single instance, is max_depth deep or all of its instances are
+ * equal. Leaves keep their #instances (tree_node::size) for
+ * path_length; labels and the split criterion play no part.
+ */
+void Tree::grow_isolation(int max_depth) {
+  vector<int> instances;
+  for (weight_list::const_iterator it = weight_list_->begin(); !it.done();
+       ++it) {
+    instances.push_back(it.instance());
+  }
+  vector<int> attrs(num_attributes_);
+  for (int i = 0; i < num_attributes_; ++i) {
+    attrs[i] = i;
+  }
+  add_node(0, instances.size(), 0);
+  for (int cur = 0; cur < nodes_.size(); ++cur) {
+    // (add_node moves the nodes, so no pointers are kept)
+    uint32 start = nodes_[cur].start;
+    uint32 end = start + nodes_[cur].size;
+    int depth = nodes_[cur].depth;
+    int attr = -1;
+    float lo, hi;
+    if (end - start > 1 && depth < max_depth) {
+      // random attributes until one is not constant in the node
+      for (int k = 0; k < attrs.size() && attr < 0; ++k) {
+        swap(attrs[k], attrs[k + rng_.uniform(attrs.size() - k)]);
+        lo = hi = set_.get_attribute(instances[start], attrs[k]);
+        for (uint32 m = start + 1; m < end; ++m) {
+          float value = set_.get_attribute(instances[m], attrs[k]);
+          lo = min(lo, value);
+          hi = max(hi, value);
+        }
+        if (lo < hi) {
+          attr = attrs[k];
         }
       }
-      // decrease in accuracy!
-      (*score)[i] = (correct - permuted);
-      // restore the proper stuff
-      subset->load_var(i, backup);
-    } else {
-      (*score)[i] = 0.0;
     }
+    if (attr < 0) {
+      nodes_[cur].label = 0;
+      mark_terminal(&nodes_[cur]);
+      continue;
+    }
+    float split_point = lo + (hi - lo) * rng_.uniform_real();
+    if (!(split_point > lo)) {
+      // neither side may be empty
+      split_point = hi;
+    }
+    uint32 mid = start;
+    for (uint32 m = start; m < end; ++m) {
+      if (set_.get_attribute(instances[m], attr) < split_point) {
+        swap(instances[m], instances[mid++]);
+      }
+    }
+    mark_split(&nodes_[cur], attr, split_point);
+    add_node(start, mid - start, depth + 1);
+    add_node(mid, end - mid, depth + 1);
   }
-  delete subset;
 }
+
+/**
+ * Depth of the leaf an instance lands in, plus c(#instances of the
+ * leaf) for the part of the tree that was not grown
+ */
+float Tree::path_length(const InstanceSet& set, int instance_no) const {
+  int terminal;
+  predict(set, instance_no, &terminal);
+  const tree_node& n = nodes_[terminal];
+  return n.depth + average_path_length(n.size);
+}
+
+float Tree::average_path_length(int n) {
+  if (n <= 1) {
+    return 0;
+  }
+  if (n == 2) {
+    return 1;
+  }
+  // 2 H(n - 1) - 2 (n - 1) / n, with H(i) ~ ln(i) + Euler's constant
+  return 2 * (log(n - 1.0) + 0.5772156649) - 2.0 * (n - 1) / n;
+}
+
 bool Tree::oob(int instance_no) const {
   return ((*weight_list_)[instance_no] == 0);
 }
 
+float Tree::instance_weight(int instance_no) const {
+  float weight = set_.weight(instance_no);
+  // (labels without a class weight count 1)
+  int label = set_.label(instance_no);
+  if (label < class_weights_.size()) {
+    weight *= class_weights_[label];
+  }
+  return weight;
+}
+
+void Tree::oob_instances(vector<int>* instances) const {
+  weight_list_->zeros(instances);
+}
+
 
 void Tree::compute_proximity(const InstanceSet& set,
                                vector<vector<float> >* prox,
@@ -9,6 +9,7 @@
 #define _TREE_H_
 #include "librf/types.h"
 #include "librf/tree_node.h"
+#include "librf/random.h"
 #include <iostream>
 #include <vector>
 #include <set>
@@ -19,6 +20,7 @@ using namespace std;
 namespace librf {
 
 class InstanceSet;
+class RowView;
 class weight_list;
 class DiscreteDist;
 
@@ -31,11 +33,16 @@ class DiscreteDist;
  * Strategy:
  *  - Binary tree in a fixed size array
  *    - #leaves is bounded by #instances!
- *  - Sorted instances kept in an special matrix such that:
+ *  - Sorted instances kept in an special matrix such that
+ *    (see TreeBuilder):
  *    - Each node has a contiguous group of rows in the matrix
  *    - Each column gives the sorted instance order with respect
  *          to a feature
  *
+ *  - If the training set has been binned (InstanceSet::create_bins)
+ *    only a single column is kept (the instances of each node, unsorted)
+ *    and splits are found from per-node histograms of the bins
+ *
  * Trees can only be created in two ways:
  *  -# load from a saved model
  *  -# grown from a certain bagging of a dataset 
@@ -48,11 +55,17 @@ class Tree {
         /// Construct a new tree by training
         Tree(const InstanceSet& set, weight_list* weights,
              int K, int min_size = 1,
-             float min_gain = 0, unsigned int seed =0);
+             float min_gain = 0, uint64 seed = 0,
+             SplitCriterionType criterion = ENTROPY,
+             const vector<float>& class_weights = vector<float>());
          ~Tree();  // clean up 
         /// predict an instance from a set
         int predict(const InstanceSet& set, int instance_no, int *terminal = NULL) const;
         int predict(const InstanceSet& set, int instance_no, vector<pair<int, float> >*) const;
+        /// predict a row of a row view
+        int predict(const RowView& rows, int i) const;
+        /// predict a raw feature vector
+        int predict(const float* features, int num_features) const;
         int terminal_node(const InstanceSet& set, int i) const;
 
         int predict_skew(const InstanceSet& set, int instance_no, float* skew, int *terminal = NULL) const;
@@ -72,70 +85,81 @@ class Tree {
         void oob_predictions(vector<DiscreteDist> *) const;
 
         void variable_importance(vector<float>* scores, unsigned int* seed) const;
+        /// Number of rows of a view predicted correctly
+        int num_correct(const RowView& rows) const;
+        /// Decrease in impurity due to each variable's splits, per
+        /// instance of the bag (filled in while growing)
+        const vector<float>& impurity_decrease() const {
+          return impurity_decrease_;
+        }
+        /// Whether the tree splits on a variable
+        bool uses_var(int var) const {
+          return vars_used_.find(var) != vars_used_.end();
+        }
         void print() const;
         // do all the work -- separated this from constructor to 
         // facilitate threading
-        void grow();
+        // nlogn: n ln(n) table shared by the trees of a forest (or NULL)
+        void grow(const vector<double>* nlogn = NULL);
+        /// Grow an isolation tree instead (see IsolationForest)
+        void grow_isolation(int max_depth);
+        /// Depth at which an instance is isolated (isolation trees)
+        float path_length(const InstanceSet& set, int instance_no) const;
+        /// Average path length of an unsuccessful search in a binary
+        /// search tree of n instances, c(n)
+        static float average_path_length(int n);
         void write(ostream& o) const;
         void read(istream& i);
 
         bool oob(int instance_no) const;
+        /// Weight of one draw of a training instance
+        /// (its sample weight times the weight of its class)
+        float instance_weight(int instance_no) const;
+        /// Out-of-bag instances (weight 0), in order
+        void oob_instances(vector<int>* instances) const;
+        /// Number of nodes (split and terminal)
+        int num_nodes() const {
+          return nodes_.size();
+        }
+        /// Node access (0 is the root)
+        const tree_node& node(int i) const {
+          return nodes_[i];
+        }
     private:
-        void copy_instances();
-        void move_data(tree_node* n, uint16 split_attr, uint16 split_idx);
-        void find_best_split(tree_node* n,
-                             const vector<int>& attrs,
-                             int* split_attr, int* split_idx,
-                             float* split_point, float* split_gain);
-        void find_best_split_for_attr(tree_node* n,
-                                      int attr,
-                                      float prior,
-                                      int* split_idx,
-                                      float *split_point,
-                                      float* best_gain);
-
+        template <typename index_t> friend class TreeBuilder;
         // Node marking
-        void add_node(uint16 start, uint16 size, uchar depth);
+        void add_node(uint32 start, uint32 size, uchar depth);
         void mark_terminal(tree_node* n);
-        void mark_split(tree_node* n, uint16 split_attr, float split_point);
+        void mark_split(tree_node* n, uint32 split_attr, float split_point);
 
-        void build_tree(int min_size);
-        void build_node(uint16 node_num, uint16 min_size);
         void print_node(int n) const;
 
         void permuteOOB(int m, double *x);
         vector<tree_node> nodes_;
-        set<uint16> vars_used_;
-        uint16 terminal_nodes_;
-        uint16 split_nodes_;
+        set<uint32> vars_used_;
+        vector<float> impurity_decrease_;
+        uint32 terminal_nodes_;
+        uint32 split_nodes_;
         // get sorted indices
         // Const reference to instance set -- we don't get to delete it
         const InstanceSet& set_;
-        // array of instance nums sorted by attributes 
-        // this is the block array that stores which instances belong to
-        // which node
-        // ex: sorted_inum_[attr*stride + start]
-        // uint16 * sorted_inum_;
-        // uint16 stride_;
-        //
-        // Turns out there is not much of a gain in batch allocating the
-        // 2d array (perhaps because, we only access a single column at a time)
-        uint16** sorted_inum_;
+        // whether to grow from the binned attributes
+        bool binned_;
         // label population 
         // uchar * sorted_labels_; necessary?
         // A single weight list for all of the instances 
         weight_list* weight_list_;
+        // weight of every label (missing ones are 1)
+        vector<float> class_weights_;
         // Depth of current tree
         // uint16 max_depth_; DEPRECATE?
-        uint16 K_;
-        uint16 min_size_;
+        uint32 K_;
+        uint32 min_size_;
         float min_gain_;
-        // scratch space
-        int* temp;
-        uchar* move_left;
-        uint16 num_instances_;
-        uint16 num_attributes_;
-        unsigned int rand_seed_;
+        SplitCriterionType criterion_;
+        uint32 num_instances_;
+        uint32 num_attributes_;
+        Random rng_;
         // Constants
         static const int kLeft;
         static const int kRight;
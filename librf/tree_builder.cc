@@ -0,0 +1,594 @@
+/**
+ * @file
+ * @brief Tree growing implementation
+ * (moved out of tree.cc so the index width can be chosen per data set)
+ */
+#include "librf/tree_builder.h"
+#include "librf/tree.h"
+#include "librf/instance_set.h"
+#include "librf/discrete_dist.h"
+#include "librf/weights.h"
+#include "librf/utils.h"
+#include <float.h>
+#include <assert.h>
+#include <math.h>
+#include <algorithm>
+
+namespace librf {
+
+template <typename index_t>
+TreeBuilder<index_t>::TreeBuilder(Tree* tree,
+                                  const vector<double>* nlogn) :
+                             tree_(tree),
+                             set_(tree->set_),
+                             weights_(*tree->weight_list_),
+                             num_instances_(tree->num_instances_),
+                             num_attributes_(tree->num_attributes_),
+                             bag_size_(0),
+                             sorted_inum_(NULL),
+                             num_sorted_(0),
+                             temp_(NULL),
+                             move_left_(NULL),
+                             nlogn_(nlogn),
+                             split_(tree->criterion_),
+                             in_node_(NULL),
+                             bin_dists_(NULL),
+                             bin_counts_(NULL),
+                             attr_order_(tree->num_attributes_) {
+  for (int i = 0; i < attr_order_.size(); ++i) {
+    attr_order_[i] = i;
+  }
+}
+
+template <typename index_t>
+TreeBuilder<index_t>::~TreeBuilder() {
+  // delete sorted_inum
+  if (sorted_inum_ != NULL) {
+    for (int i = 0; i <num_sorted_; ++i) {
+      delete [] sorted_inum_[i];
+    }
+    delete [] sorted_inum_;
+  }
+  delete [] temp_;
+  delete [] move_left_;
+  delete [] in_node_;
+  delete [] bin_dists_;
+  delete [] bin_counts_;
+}
+
+// Split half way between two values -- but always strictly above cur,
+// so (value < split point) agrees with the sorted order
+static float split_between(float cur, float next) {
+  float split_point = (cur + next) / 2.0;
+  return (split_point > cur) ? split_point : next;
+}
+
+/**
+ * Whether a node of the given size finds its splits by sorting the
+ * candidate attributes locally (instead of using presorted columns)
+ */
+template <typename index_t>
+bool TreeBuilder<index_t>::use_local_sort(uint32 size) const {
+  if (tree_->binned_) {
+    return false;
+  }
+  if (size < 2 || set_.sparse()) {
+    return true;
+  }
+  return tree_->K_ * log2(double(size)) < num_attributes_;
+}
+
+/***
+ * Copy the sorted indices from the training set
+ * into our special matrix (sorted_inum)
+ * Only the instances in the bag (nonzero weight) are copied: the rest
+ * would only be carried along through every split. They are numbered
+ * by their row in the bag (in instance order), and the label and
+ * weight of every row are kept next to each other.
+ * In binned mode (or if even the root sorts locally),
+ * only the row numbers are needed
+ */
+template <typename index_t>
+void TreeBuilder<index_t>::copy_instances() {
+  for (weight_list::const_iterator it = weights_.begin(); !it.done(); ++it) {
+    bag_.push_back(it.instance());
+    bag_label_.push_back(set_.label(it.instance()));
+    bag_weight_.push_back(it.weight() * tree_->instance_weight(it.instance()));
+  }
+  bag_size_ = bag_.size();
+  // every row number has to fit in index_t
+  assert(bag_size_ == 0 || bag_size_ - 1 <= index_t(-1));
+  if (tree_->binned_ || use_local_sort(bag_size_)) {
+    num_sorted_ = 1;
+    sorted_inum_ = new index_t*[1];
+    sorted_inum_[0] = new index_t[bag_size_];
+    for (uint32 k = 0; k < bag_size_; ++k) {
+      sorted_inum_[0][k] = k;
+    }
+    if (tree_->binned_) {
+      bin_dists_ = new DiscreteDist[256];
+      bin_counts_ = new int[256];
+    }
+  } else {
+    num_sorted_ = num_attributes_;
+    sorted_inum_ = new index_t*[num_attributes_];
+    // row of each instance in the bag
+    vector<index_t> row(num_instances_, 0);
+    vector<bool> in_bag(num_instances_, false);
+    for (uint32 k = 0; k < bag_size_; ++k) {
+      row[bag_[k]] = k;
+      in_bag[bag_[k]] = true;
+    }
+    for (int i = 0; i <num_attributes_; ++i) {
+      const int* sorted = set_.get_sorted_indices(i);
+      sorted_inum_[i] = new index_t[bag_size_];
+      uint32 k = 0;
+      for (uint32 j = 0; j < num_instances_; ++j) {
+        if (in_bag[sorted[j]]) {
+          sorted_inum_[i][k++] = row[sorted[j]];
+        }
+      }
+    }
+  }
+  temp_ = new index_t[bag_size_];
+  move_left_ = new uchar[bag_size_];
+  for (uint32 i = 0; i < bag_size_; ++i) {
+    move_left_[i] = 0;
+  }
+  if (set_.sparse()) {
+    in_node_ = new uint32[num_instances_];
+    for (uint32 i = 0; i < num_instances_; ++i) {
+      in_node_[i] = 0;
+    }
+  }
+}
+
+/**
+ * - Copy the data into special matrix
+ * - Build the tree (breadth first)
+ */
+template <typename index_t>
+void TreeBuilder<index_t>::build() {
+  copy_instances();
+  if (tree_->criterion_ == ENTROPY && nlogn_ != NULL) {
+    double total = 0;
+    bool integral = true;
+    for (uint32 row = 0; row < bag_size_; ++row) {
+      total += bag_weight_[row];
+      integral = integral && (bag_weight_[row] == floor(bag_weight_[row]));
+    }
+    // any weight of a node is at most the total; bags the table does
+    // not cover compute w ln(w) instead
+    if (integral && total + 0.5 < nlogn_->size()) {
+      split_.set_nlogn_table(nlogn_);
+    }
+  }
+  uint32 built_nodes = 0;
+  // set up ROOT NODE (constains all instances)
+  tree_->add_node(0, bag_size_, 0);
+  do {
+    build_node(built_nodes);
+    built_nodes++;
+  } while (built_nodes < tree_->nodes_.size());
+}
+
+template <typename index_t>
+void TreeBuilder<index_t>::build_node(uint32 node_num) {
+  // cout << "building node " << node_num <<endl;
+  assert(node_num < tree_->nodes_.size());
+  tree_node* n = &tree_->nodes_[node_num];
+  // Calculate starting entropy (or gini)
+  node_dist_.clear();
+  uint32 nstart = n->start;
+  uint32 nend = n->start + n->size;
+  for (uint32 i = n->start; i < nend; ++i) {
+    uint32 row = sorted_inum_[0][i];
+    node_dist_.add(bag_label_[row], bag_weight_[row]);
+  }
+  n->entropy = node_dist_.impurity(tree_->criterion_);
+  // cout << "entropy: " << n-> entropy << endl;
+  n->label = node_dist_.mode();
+
+  // Min_size or completely pure check
+  if (n->size <= tree_->min_size_ || n->entropy == 0) { //|| n->depth >= (max_depth_ -1)) {
+    tree_->mark_terminal(n);
+    /* if (n->size <= min_size) {
+       cout << "terminal due to size of " << n->size << endl;
+    } else if (n->entropy==0) {
+      cout << "terminal due to zero entropy" << endl;
+    } else  {
+      cout << "terminal due to depth: " << int(n->depth) << endl;
+    }*/
+    return;
+  }
+
+  int split_attr, split_idx;
+  float split_point, split_gain;
+  vector<int> attrs;
+  bool local = use_local_sort(n->size);
+  // every node draws from a stream of its own
+  Random rng = tree_->rng_.stream(node_num);
+  random_sample(tree_->K_, &attr_order_, &attrs, &rng);
+  find_best_split(n, attrs, local, &split_attr, &split_idx, &split_point,
+                  &split_gain);
+  if (split_gain > tree_->min_gain_) {
+    // weighted impurity decrease (mean decrease in impurity importance)
+    tree_->impurity_decrease_[split_attr] += node_dist_.sum() * split_gain;
+    tree_->mark_split(n, split_attr, split_point);
+    move_data(n, split_attr, split_idx, local);
+    uint32 left_size = split_idx - n->start + 1;
+    uint32 right_size = n->size - left_size;
+    uchar depth = n->depth;
+    // n is invalid after add_node (nodes_ may be reallocated)
+    tree_->add_node(nstart, left_size, depth + 1);
+    tree_->add_node(split_idx + 1, right_size, depth + 1);
+   } else {
+    // cout << "couldn't find a split" << endl;
+    tree_->mark_terminal(n);
+   }
+}
+
+template <typename index_t>
+void TreeBuilder<index_t>::move_data(tree_node* n, uint32 split_attr,
+                                     uint32 split_idx, bool local) {
+// PRE-CONDITION
+// the same number of distinct case numbers are found in
+// sorted_inum_[m][nstart-nend] for all m that are still used
+
+// Step 1:
+// Create an indicator bit set for moving left
+// ex. move_left[instance number]
+// (only the node's instances are set, and they are cleared again below)
+  uint32 nstart = n->start;
+  uint32 nend = nstart + n->size;
+  const vector<uint32>* nonzeros = NULL;
+  if (set_.sparse()) {
+    nonzeros = &set_.nonzero_instances(split_attr);
+    if (n->size * log2(double(nonzeros->size() + 1)) < nonzeros->size()) {
+      // few instances: look them up (below)
+      nonzeros = NULL;
+    }
+  }
+  if (nonzeros != NULL) {
+    // all the zeros go the same way, so only the nonzero values of the
+    // node have to be tested
+    const vector<float>& values = set_.nonzero_values(split_attr);
+    uchar zero_left = (0 < n->split_point);
+    for (uint32 i = nstart; i < nend; ++i) {
+      uint32 row = sorted_inum_[0][i];
+      move_left_[row] = zero_left;
+      in_node_[bag_[row]] = row + 1;
+    }
+    for (uint32 k = 0; k < nonzeros->size(); ++k) {
+      uint32 row_plus_one = in_node_[(*nonzeros)[k]];
+      if (row_plus_one) {
+        move_left_[row_plus_one - 1] = (values[k] < n->split_point);
+      }
+    }
+    for (uint32 i = nstart; i < nend; ++i) {
+      in_node_[bag_[sorted_inum_[0][i]]] = 0;
+    }
+  } else if (tree_->binned_ || local) {
+    // column 0 isn't sorted by the split attr -- test the split point
+    for (uint32 i = nstart; i < nend; ++i) {
+      uint32 row = sorted_inum_[0][i];
+      move_left_[row] =
+        (set_.get_attribute(bag_[row], split_attr) < n->split_point);
+    }
+  } else {
+    for (uint32 i = nstart; i <=split_idx; ++i) {
+      move_left_[sorted_inum_[split_attr][i]] = 1;
+    }
+  }
+
+// Step 2:
+// For every attribute the children will use
+// (only column 0 if both of them sort locally)
+//    fill a temporary vector -- move left | move right
+//    write this back to the sorted_inum_
+  uint32 left_size = split_idx + 1 - nstart;
+  uint32 num_columns = num_sorted_;
+  if (use_local_sort(left_size) && use_local_sort(n->size - left_size)) {
+    num_columns = 1;
+  }
+  for (uint32 attr = 0; attr < num_columns; ++attr) {
+    uint32 left = n->start;
+    uint32 right = split_idx + 1;
+    index_t* column = sorted_inum_[attr];
+    // Move row numbers Left and right
+    for (uint32 i = nstart; i < nend; ++i) {
+      index_t row = column[i];
+      if (move_left_[row]) {
+        assert(left < bag_size_);
+        temp_[left++] = row;
+      } else {
+        assert(right < bag_size_);
+        temp_[right++] = row;
+      }
+    }
+    assert(left == split_idx + 1);
+    // Write temp back to sorted_inum
+    for (uint32 i = nstart; i < nend; ++i) {
+      column[i] = temp_[i];
+    }
+   }
+  for (uint32 i = nstart; i < nend; ++i) {
+    move_left_[sorted_inum_[0][i]] = 0;
+  }
+// POST-CONDITION
+// sorted_instances_[m][nstart-split] are consistent
+// sorted_instances_[m][split-nend] are consistent
+}
+
+template <typename index_t>
+void TreeBuilder<index_t>::find_best_split(tree_node* n,
+                                           const vector<int>& attrs,
+                                           bool local,
+                                           int* split_attr, int* split_idx,
+                                           float* split_point,
+                                           float* split_gain) {
+  float best_gain = -DBL_MAX;
+	int best_attr = -1;
+  int best_split_idx = -1;
+	float best_split_point = -DBL_MAX;
+  uint32 nstart = n->start;
+  uint32 nend = n->start + n->size;
+  if (set_.sparse()) {
+    for (uint32 i = nstart; i < nend; ++i) {
+      uint32 row = sorted_inum_[0][i];
+      in_node_[bag_[row]] = row + 1;
+    }
+  }
+	for (int i = 0; i < attrs.size(); ++i) {
+    int attr =attrs[i];
+    // cout << "investigating attr #" << attr <<endl;
+		int curr_split_idx = -999;
+    float curr_split_point = -999;
+		float curr_gain = -DBL_MAX;
+    if (tree_->binned_) {
+      find_best_split_for_attr_binned(n, attr, n->entropy, &curr_split_idx,
+                                      &curr_split_point, &curr_gain);
+    } else if (set_.sparse()) {
+      find_best_split_for_attr_sparse(n, attr, n->entropy, &curr_split_idx,
+                                      &curr_split_point, &curr_gain);
+    } else if (local) {
+      find_best_split_for_attr_local(n, attr, n->entropy, &curr_split_idx,
+                                     &curr_split_point, &curr_gain);
+    } else {
+      find_best_split_for_attr(n, attr, n->entropy, &curr_split_idx,
+                               &curr_split_point, &curr_gain);
+    }
+    // cout << attr << ":" << curr_split_point << "->" << curr_gain <<endl;
+		if (curr_gain > best_gain) {
+				best_gain = curr_gain;
+				best_split_idx = curr_split_idx;
+        best_split_point = curr_split_point;
+				best_attr = attr;
+        assert(best_split_idx >=0);
+        assert(best_split_idx < bag_size_);
+		}
+	}
+  if (set_.sparse()) {
+    for (uint32 i = nstart; i < nend; ++i) {
+      in_node_[bag_[sorted_inum_[0][i]]] = 0;
+    }
+  }
+  // get the split point
+	*split_point = best_split_point;
+	*split_attr = best_attr;
+  *split_idx = best_split_idx;
+	*split_gain = best_gain;
+}
+
+template <typename index_t>
+void TreeBuilder<index_t>::find_best_split_for_attr(tree_node* n,
+                                                    int attr,
+                                                    float prior_entropy,
+                                                    int* split_idx,
+                                                    float* split_point,
+                                                    float* best_gain) {
+  uint32 nstart = n->start;
+  uint32 nend = n->start + n->size;
+  const index_t* column = sorted_inum_[attr];
+  // Move all the instances into the right split at first
+  split_.reset(node_dist_);
+  // set up initial values
+  *best_gain = -DBL_MAX;
+  uint32 next = column[nstart];
+  float next_value = set_.get_attribute(bag_[next], attr);
+  // Look for splits
+  for (uint32 i = nstart; i < nend - 1; ++i) {
+    uint32 cur = next;
+    next = column[i + 1];
+    split_.move_left(bag_label_[cur], bag_weight_[cur]);
+    float cur_value =  next_value;
+    next_value = set_.get_attribute(bag_[next], attr);
+    if (cur_value < next_value) {
+      float curr_gain = prior_entropy - split_.impurity();
+      // cout << "split point: " << (cur_value + next_value)/2.0 << " gain: " << curr_gain << endl;
+      if (curr_gain > *best_gain) {
+        *best_gain = curr_gain;
+        *split_idx = i;
+        *split_point = split_between(cur_value, next_value);
+      }
+    }
+  }
+}
+
+/**
+ * Same scan as find_best_split_for_attr, but the node's instances are
+ * sorted here instead of coming from a presorted column
+ */
+template <typename index_t>
+void TreeBuilder<index_t>::find_best_split_for_attr_local(tree_node* n,
+                                                    int attr,
+                                                    float prior_entropy,
+                                                    int* split_idx,
+                                                    float* split_point,
+                                                    float* best_gain) {
+  uint32 nstart = n->start;
+  uint32 nend = n->start + n->size;
+  local_.clear();
+  for (uint32 i = nstart; i < nend; ++i) {
+    index_t row = sorted_inum_[0][i];
+    local_.push_back(make_pair(set_.get_attribute(bag_[row], attr), row));
+  }
+  sort(local_.begin(), local_.end());
+  split_.reset(node_dist_);
+  *best_gain = -DBL_MAX;
+  for (uint32 i = 0; i + 1 < local_.size(); ++i) {
+    uint32 cur = local_[i].second;
+    split_.move_left(bag_label_[cur], bag_weight_[cur]);
+    float cur_value = local_[i].first;
+    float next_value = local_[i + 1].first;
+    if (cur_value < next_value) {
+      float curr_gain = prior_entropy - split_.impurity();
+      if (curr_gain > *best_gain) {
+        *best_gain = curr_gain;
+        *split_idx = nstart + i;
+        *split_point = split_between(cur_value, next_value);
+      }
+    }
+  }
+}
+
+/**
+ * Local split search for a sparse attribute
+ * Only the node's nonzero values are gathered and sorted; the zeros
+ * are one block (value 0) between the negative and positive values.
+ * The nonzeros are found by looking each instance up in the column,
+ * or, if the column is short compared to that, by scanning the column
+ * for instances of the node.
+ */
+template <typename index_t>
+void TreeBuilder<index_t>::find_best_split_for_attr_sparse(tree_node* n,
+                                                    int attr,
+                                                    float prior_entropy,
+                                                    int* split_idx,
+                                                    float* split_point,
+                                                    float* best_gain) {
+  uint32 nstart = n->start;
+  uint32 nend = n->start + n->size;
+  const vector<uint32>& instances = set_.nonzero_instances(attr);
+  const vector<float>& values = set_.nonzero_values(attr);
+  local_.clear();
+  nonzero_dist_.clear();
+  if (n->size * log2(double(instances.size() + 1)) < instances.size()) {
+    for (uint32 i = nstart; i < nend; ++i) {
+      index_t row = sorted_inum_[0][i];
+      float value = set_.get_attribute(bag_[row], attr);
+      if (value != 0) {
+        local_.push_back(make_pair(value, row));
+      }
+    }
+  } else {
+    for (uint32 k = 0; k < instances.size(); ++k) {
+      uint32 row_plus_one = in_node_[instances[k]];
+      if (row_plus_one) {
+        local_.push_back(make_pair(values[k], index_t(row_plus_one - 1)));
+      }
+    }
+  }
+  sort(local_.begin(), local_.end());
+  for (uint32 i = 0; i < local_.size(); ++i) {
+    uint32 row = local_[i].second;
+    nonzero_dist_.add(bag_label_[row], bag_weight_[row]);
+  }
+  uint32 num_zeros = n->size - local_.size();
+  split_.reset(node_dist_);
+  *best_gain = -DBL_MAX;
+  // Move the values left in sorted order (i: next nonzero), with the
+  // zero block right before the first positive value
+  uint32 i = 0;
+  uint32 left_count = 0;
+  bool zeros_right = (num_zeros > 0);
+  while (left_count < n->size) {
+    float cur_value;
+    if (zeros_right && (i == local_.size() || local_[i].first > 0)) {
+      for (int label = 0; label < node_dist_.num_labels(); ++label) {
+        split_.move_left(label, node_dist_.weight(label) -
+                                nonzero_dist_.weight(label));
+      }
+      left_count += num_zeros;
+      zeros_right = false;
+      cur_value = 0;
+    } else {
+      uint32 cur = local_[i].second;
+      split_.move_left(bag_label_[cur], bag_weight_[cur]);
+      left_count++;
+      cur_value = local_[i].first;
+      ++i;
+    }
+    if (left_count == n->size) {
+      break;
+    }
+    float next_value;
+    if (zeros_right && (i == local_.size() || local_[i].first > 0)) {
+      next_value = 0;
+    } else {
+      next_value = local_[i].first;
+    }
+    if (cur_value < next_value) {
+      float curr_gain = prior_entropy - split_.impurity();
+      if (curr_gain > *best_gain) {
+        *best_gain = curr_gain;
+        *split_idx = nstart + left_count - 1;
+        *split_point = split_between(cur_value, next_value);
+      }
+    }
+  }
+}
+
+/**
+ * Histogram version of find_best_split_for_attr
+ * Accumulates the label distribution of every bin in one pass over
+ * the node, then scans the bins instead of the sorted instances.
+ */
+template <typename index_t>
+void TreeBuilder<index_t>::find_best_split_for_attr_binned(tree_node* n,
+                                                    int attr,
+                                                    float prior_entropy,
+                                                    int* split_idx,
+                                                    float* split_point,
+                                                    float* best_gain) {
+  uint32 nstart = n->start;
+  uint32 nend = n->start + n->size;
+  int num_bins = set_.num_bins(attr);
+  for (int b = 0; b < num_bins; ++b) {
+    bin_dists_[b].clear();
+    bin_counts_[b] = 0;
+  }
+  for (uint32 i = nstart; i < nend; ++i) {
+    uint32 row = sorted_inum_[0][i];
+    int bin = set_.get_bin(bag_[row], attr);
+    bin_dists_[bin].add(bag_label_[row], bag_weight_[row]);
+    bin_counts_[bin]++;
+  }
+  split_.reset(node_dist_);
+  *best_gain = -DBL_MAX;
+  // Everything up to (and including) bin b goes left
+  uint32 left_count = 0;
+  for (int b = 0; b < num_bins - 1; ++b) {
+    if (bin_counts_[b] == 0) {
+      continue;
+    }
+    for (int label = 0; label < bin_dists_[b].num_labels(); ++label) {
+      split_.move_left(label, bin_dists_[b].weight(label));
+    }
+    left_count += bin_counts_[b];
+    if (left_count == n->size) {
+      break;
+    }
+    float curr_gain = prior_entropy - split_.impurity();
+    if (curr_gain > *best_gain) {
+      *best_gain = curr_gain;
+      *split_idx = nstart + left_count - 1;
+      *split_point = set_.bin_cut(attr, b);
+    }
+  }
+}
+
+template class TreeBuilder<uint16>;
+template class TreeBuilder<uint32>;
+
+} // namespace
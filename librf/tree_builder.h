@@ -0,0 +1,129 @@
+/**
+ * @file
+ * @brief Working state for growing a single tree
+ *
+ * The sorted instance matrix is by far the biggest thing a tree needs
+ * while growing (#attributes x #bag entries). Only the instances of the
+ * bag are kept (instances with weight 0 play no part in any split), and
+ * they are numbered by their row in the bag, so the index type is a
+ * template parameter: uint16 keeps the compact layout for bags of up to
+ * 65536 distinct instances (whatever the size of the training set),
+ * uint32 handles anything larger. Tree::grow picks the builder from the
+ * size of the bag.
+ *
+ * Keeping every presorted column partitioned costs O(#attributes) per
+ * instance per split, even though only K attributes are looked at.
+ * Once K log(node size) drops below #attributes it is cheaper to sort
+ * the K candidate attributes of a node locally, so from there on
+ * (node sizes only shrink) only the column holding the node's instances
+ * is partitioned. With many attributes this is true from the root on,
+ * and the presorted columns are never copied at all.
+ *
+ * Sparse sets always sort locally, and only their nonzero values:
+ * all the zeros of a node sit in one block between the negative and
+ * the positive values, and move across a split point together.
+ */
+#ifndef _TREE_BUILDER_H_
+#define _TREE_BUILDER_H_
+
+#include "librf/types.h"
+#include "librf/discrete_dist.h"
+#include <vector>
+#include <utility>
+
+using namespace std;
+
+namespace librf {
+
+class Tree;
+class InstanceSet;
+class weight_list;
+struct tree_node;
+
+template <typename index_t>
+class TreeBuilder {
+  public:
+    /// nlogn: n ln(n) table (DiscreteDist::nlogn_table), used when
+    /// the bag weights are integers and their total fits (NULL: none)
+    TreeBuilder(Tree* tree, const vector<double>* nlogn = NULL);
+    ~TreeBuilder();
+    /// Grow the tree's nodes
+    void build();
+  private:
+    void copy_instances();
+    void build_node(uint32 node_num);
+    bool use_local_sort(uint32 size) const;
+    void move_data(tree_node* n, uint32 split_attr, uint32 split_idx,
+                   bool local);
+    void find_best_split(tree_node* n,
+                         const vector<int>& attrs,
+                         bool local,
+                         int* split_attr, int* split_idx,
+                         float* split_point, float* split_gain);
+    void find_best_split_for_attr(tree_node* n,
+                                  int attr,
+                                  float prior,
+                                  int* split_idx,
+                                  float *split_point,
+                                  float* best_gain);
+    void find_best_split_for_attr_local(tree_node* n,
+                                        int attr,
+                                        float prior,
+                                        int* split_idx,
+                                        float *split_point,
+                                        float* best_gain);
+    void find_best_split_for_attr_sparse(tree_node* n,
+                                         int attr,
+                                         float prior,
+                                         int* split_idx,
+                                         float *split_point,
+                                         float* best_gain);
+    void find_best_split_for_attr_binned(tree_node* n,
+                                         int attr,
+                                         float prior,
+                                         int* split_idx,
+                                         float *split_point,
+                                         float* best_gain);
+    Tree* tree_;
+    const InstanceSet& set_;
+    const weight_list& weights_;
+    uint32 num_instances_;
+    uint32 num_attributes_;
+    // #instances in the bag (the rows of sorted_inum_)
+    uint32 bag_size_;
+    // instance number, label and weight of every row
+    // (multiplicity x Tree::instance_weight)
+    vector<uint32> bag_;
+    vector<uchar> bag_label_;
+    vector<float> bag_weight_;
+    // array of row nums sorted by attributes
+    // this is the block array that stores which rows belong to
+    // which node
+    index_t** sorted_inum_;
+    // number of columns in sorted_inum_
+    // (1 when binned, or when the root is already sorted locally)
+    uint32 num_sorted_;
+    // scratch space
+    index_t* temp_;
+    uchar* move_left_;  // by row
+    // label distribution of the node being built
+    DiscreteDist node_dist_;
+    // n ln(n) lookup for the entropy (shared, read only; NULL if none)
+    const vector<double>* nlogn_;
+    SplitImpurity split_;
+    // (value, instance) pairs of a node (local sorting)
+    vector< pair<float, index_t> > local_;
+    // row + 1 of the instances of the node being split, by instance
+    // number (sparse sets; 0: not in the node)
+    uint32* in_node_;
+    // label distribution of a node's nonzero values (sparse sets)
+    DiscreteDist nonzero_dist_;
+    // histogram scratch space (binned mode)
+    DiscreteDist* bin_dists_;
+    int* bin_counts_;
+    // attribute order for sampling the K candidates of a node
+    vector<int> attr_order_;
+};
+
+} // namespace
+#endif
@@ -26,11 +26,11 @@ struct tree_node {
                right(0){}
   NodeStatusType status;
   uchar label;
-  uint16 attr;
-  uint16 start;
-  uint16 size;
-  uint16 left;
-  uint16 right;
+  uint32 attr;
+  uint32 start;
+  uint32 size;
+  uint32 left;
+  uint32 right;
   float entropy;
   float split_point;
   uchar depth;
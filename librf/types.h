@@ -4,9 +4,13 @@
 namespace librf {
 
 typedef unsigned int uint32;
+typedef unsigned long long uint64;
 typedef unsigned short uint16;
 typedef unsigned char uchar;
 typedef unsigned char byte;
 
+/// Impurity measure used to pick splits
+typedef enum {ENTROPY, GINI} SplitCriterionType;
+
 } // namespace
 #endif
@@ -3,30 +3,28 @@
 #define _UTILS_H_
 
 #include <vector>
-#include <stdlib.h>
+#include <algorithm>
+#include "librf/random.h"
+
+using namespace std;
 
 namespace librf {
-/// Sample without replacment
-// Fix provided by naoki.tanaka@naoki.tanaka@jp.astellas.com
-void random_sample(int n, int K, vector<int>*v, unsigned int* seed) {
-  if (K < n) {
-  int pop = n;
-  v->reserve(K);
-  for (int i = K; i > 0; --i) {
-    float cumprob = 1.0;
-    float x;
-    do {
-      x = float(rand_r(seed))/RAND_MAX;
-    } while (x == 1);
-    for (; x < cumprob; pop--) {
-      cumprob -= cumprob * i /pop;
-    }
-    v->push_back(n - pop - 1);
+/**
+ * Sample K of 0..n-1 without replacement in O(K): a partial shuffle of
+ * order, which holds any permutation of 0..n-1 (ex. the identity at
+ * first) and is left shuffled for the next call -- the sample is
+ * uniform whatever the permutation it starts from
+ */
+inline void random_sample(int K, vector<int>* order, vector<int>* v,
+                          Random* rng) {
+  int n = order->size();
+  if (K > n) {
+    K = n;
   }
-  } else {
-    for (int i =0; i < n; i++) {
-      v->push_back(i);
-    }
+  v->resize(K);
+  for (int i = 0; i < K; ++i) {
+    swap((*order)[i], (*order)[i + rng->uniform(n - i)]);
+    (*v)[i] = (*order)[i];
   }
 }
 // slow and stupid median
@@ -1,157 +1,167 @@
 /* weights.h
  * Instance Weights:
  *
- * this is trying to be a memory "smart" container that will decide
- * whether or not to use sparse/dense representation yet
- * still provide a uniform interface.
+ * this is a memory "smart" container that decides whether to use a
+ * sparse or a dense representation, yet still provides a uniform
+ * interface.
+ *
+ * It is possible to do this because we know how many training
+ * instances there are apriori, and how many will be added (the
+ * density: ex. the size of the bag)
+ *
+ * A tree keeps its weight list for its whole life (for OOB), so for
+ * small bags of big sets the dense array would dominate the memory
+ * of the forest.
+ *
+ * The weights are multiplicities (#times an instance was drawn into a
+ * bag); real valued sample and class weights are applied on top of
+ * them by the tree (see Tree). A multiplicity takes a byte, and the
+ * rare ones that don't fit (ex. balanced bags of a tiny class) are
+ * kept on the side.
  *
- * It is possible to do this because - we know how many training 
- * instances there are apriori - and each time we split a node
- * we will know how many instances are going to the left/right
- * subtrees
- * 
  * approx mem usage:
- *  sparse: density * 5 bytes + map overhead
+ *  sparse: density * 5 bytes (sorted instance numbers + weights)
  *  dense: num_instances bytes
+ *
+ * In the sparse representation, instances have to be added in
+ * instance order (adding the same instance again adds to its weight):
+ * lookups are then a binary search. Either way the nonzero weights
+ * can be walked in instance order with a const_iterator.
  */
 #ifndef _WEIGHTS_H_
 #define _WEIGHTS_H_
 
 #include <vector>
-#include <iostream>
+#include <map>
+#include <algorithm>
+#include <assert.h>
 #include "librf/types.h"
 
 using namespace std;
 
 namespace librf {
 
-/*
-using ::__gnu_cxx::hash_map;
-class weight_interface {
-  public:
-    weight_interface(int max_size) {
-      sum_ = 0;
-    }
-    unsigned int sum() {
-       return sum_;
-    }
-    void add_instance(int instance, byte num =1) {
-      sum_ += num;
-      add_instance_impl(instance, num);
-    }
-    byte get_weight(int instance) const{
-      return get_weight_impl(instance);
-    }
-  private:
-    unsigned int sum_;
-    virtual void add_instance_impl(int instance, byte num) = 0;
-    virtual byte get_weight_impl(int instance) const = 0;
-};
-
-
-// need a smart iterator
-class sparse_weight : public weight_interface {
- public:
- sparse_weight(int size) : weight_interface(size) {
- }
- private:
-    virtual void add_instance_impl(int i, byte num) {
-      byte_map::iterator it = store_.find(i);
-      if (it != store_.end()) {
-        it->second += num;
-      } else {
-        store_[i] = num;
-      }
-    }
-    virtual byte get_weight_impl(int i) const {
-      byte_map::const_iterator it = store_.find(i);
-      if (it != store_.end()) {
-        return it->second;
-      }
-      return 0;
-    }
-    typedef google::dense_hash_map<int, byte> byte_map;
-    byte_map store_;
-};
-
-class dense_weight : public weight_interface {
-  public:
-  dense_weight(int max_size) : weight_interface(max_size),
-                               store_(max_size,0) {
-  }
-  private:
-    // virtual init_impl(int max_size) {
-    //  store_.resize(max_size, 0);
-    // }
-    virtual void add_instance_impl(int i, byte num) {
-      // cout << int(this) <<" dense add " << i << "," << int(num) << endl;
-      store_[i] += num;
-    }
-    virtual byte get_weight_impl(int i) const {
-      return  store_[i];
-    }
-    vector<byte> store_;
-};
-
-/*
 class weight_list {
   public:
-    weight_list(int n, int density) : num_instances_(n){
-      int sparse_cost = density * 5;
-      if (sparse_cost < num_instances_) {
-        // cout << "creating sparse" << endl;
-        impl = new sparse_weight(num_instances_);
-      } else {
-        // cout << "creating dense " << density << "/" << num_instances_ << endl;
-        impl = new dense_weight(num_instances_);
-      }
-    }
-    byte operator[](int i) const{
-      return impl->get_weight(i);
-    }
-    void add(int i, byte num = 1) {
-      impl->add_instance(i, num);
-    }
-    int size() const {
-      return num_instances_;
-    }
-    int sum() const {
-      return impl->sum();
-    }
-    ~weight_list() {
-       delete impl;
-    }
-  private:
-    int num_instances_;
-    weight_interface *impl;
-};*/
-
-class weight_list {
-  public:
-   weight_list(int n, int density) : num_instances_(n), sum_(0){
-      array_ = new byte[n];
-      for(int i =0; i < n; ++i) {
-        array_[i] = 0;
-      }
+   weight_list(int n, int density) : sum_(0), num_instances_(n),
+                                     sparse_(density * 5 < n) {
+     if (!sparse_) {
+       array_.resize(n, 0);
+     }
    }
-   byte operator[](int i) const {
-    return array_[i];
+   unsigned int operator[](int i) const {
+     int pos = position(i);
+     return (pos < 0) ? 0 : count(pos);
    }
-   void add(int i, byte num =1){
-    array_[i]+=num;
-    sum_+=num;
+   void add(int i, unsigned int num =1){
+     int pos = i;
+     if (sparse_) {
+       if (index_.empty() || index_.back() != uint32(i)) {
+         // (sparse lists are filled in instance order)
+         assert(index_.empty() || index_.back() < uint32(i));
+         index_.push_back(i);
+         array_.push_back(0);
+       }
+       pos = array_.size() - 1;
+     }
+     set_count(pos, count(pos) + num);
+     sum_ += num;
    }
    int size() const { return num_instances_;}
    int sum() const {
       return sum_;
    }
-   ~weight_list(){
-     delete[] array_;
+   bool sparse() const {
+     return sparse_;
+   }
+   /// #instances with a nonzero weight
+   int num_nonzero() const {
+     return array_.size() - std::count(array_.begin(), array_.end(), byte(0));
+   }
+   /// Instances with weight 0 (ex. out of bag), in order
+   void zeros(vector<int>* instances) const {
+     const_iterator it = begin();
+     for (int i = 0; i < num_instances_; ++i) {
+       if (!it.done() && it.instance() == i) {
+         ++it;
+       } else {
+         instances->push_back(i);
+       }
+     }
+   }
+   /// Walks the nonzero weights in instance order
+   class const_iterator {
+     public:
+      bool done() const {
+        return pos_ >= end_;
+      }
+      int instance() const {
+        return list_.sparse_ ? list_.index_[pos_] : pos_;
+      }
+      unsigned int weight() const {
+        return list_.count(pos_);
+      }
+      const_iterator& operator++() {
+        ++pos_;
+        skip_zeros();
+        return *this;
+      }
+     private:
+      friend class weight_list;
+      const_iterator(const weight_list& list) : list_(list), pos_(0),
+                                                 end_(list.array_.size()) {
+        skip_zeros();
+      }
+      void skip_zeros() {
+        while (pos_ < end_ && list_.array_[pos_] == 0) {
+          ++pos_;
+        }
+      }
+      const weight_list& list_;
+      int pos_;
+      int end_;
+   };
+   const_iterator begin() const {
+     return const_iterator(*this);
    }
   private:
+   // position of instance i in array_ (-1: weight 0)
+   int position(int i) const {
+     if (!sparse_) {
+       return i;
+     }
+     vector<uint32>::const_iterator it = lower_bound(index_.begin(),
+                                                     index_.end(),
+                                                     uint32(i));
+     if (it != index_.end() && *it == uint32(i)) {
+       return it - index_.begin();
+     }
+     return -1;
+   }
+   unsigned int count(int pos) const {
+     if (array_[pos] < kOverflow) {
+       return array_[pos];
+     }
+     return overflow_.find(pos)->second;
+   }
+   void set_count(int pos, unsigned int c) {
+     if (c < kOverflow) {
+       array_[pos] = c;
+     } else {
+       array_[pos] = kOverflow;
+       overflow_[pos] = c;
+     }
+   }
+   static const byte kOverflow = 255;
    int sum_;
    int num_instances_;
-   byte* array_;
+   bool sparse_;
+   // weights (dense: by instance; sparse: by entry of index_)
+   vector<byte> array_;
+   // instance number of each entry (sparse only, increasing)
+   vector<uint32> index_;
+   // weights of kOverflow or more, by position in array_
+   map<int, unsigned int> overflow_;
 };
 
 } // namespace
@@ -0,0 +1,36 @@
+#include "librf/discrete_dist.h"
+#include <UnitTest++.h>
+#include <iostream>
+using namespace std;
+using namespace librf;
+
+// The incremental split impurity has to agree with the
+// direct computation for every split point
+TEST(SplitImpurityCheck) {
+  int labels[] = {0, 1, 1, 0, 1, 1, 1, 0, 0, 1};
+  int weights[] = {1, 2, 0, 3, 1, 1, 4, 1, 2, 1};
+  int n = 10;
+  DiscreteDist all;
+  for (int i = 0; i < n; ++i) {
+    all.add(labels[i], weights[i]);
+  }
+  vector<double> nlogn;
+  DiscreteDist::nlogn_table(all.sum(), &nlogn);
+  SplitImpurity entropy(ENTROPY, &nlogn);
+  SplitImpurity gini(GINI, &nlogn);
+  entropy.reset(all);
+  gini.reset(all);
+  DiscreteDist split[2];
+  split[1] = all;
+  for (int i = 0; i < n - 1; ++i) {
+    entropy.move_left(labels[i], weights[i]);
+    gini.move_left(labels[i], weights[i]);
+    split[1].remove(labels[i], weights[i]);
+    split[0].add(labels[i], weights[i]);
+    CHECK_CLOSE(DiscreteDist::entropy_conditioned(split, 2),
+                entropy.impurity(), 1e-5);
+    float expected_gini = (split[0].sum() * split[0].gini() +
+                           split[1].sum() * split[1].gini()) / all.sum();
+    CHECK_CLOSE(expected_gini, gini.impurity(), 1e-5);
+  }
+}
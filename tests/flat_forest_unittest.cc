@@ -0,0 +1,109 @@
+#include "librf/random_forest.h"
+#include "librf/instance_set.h"
+#include "librf/flat_forest.h"
+#include <UnitTest++.h>
+#include <iostream>
+#include <sstream>
+#include <fstream>
+#include <unistd.h>
+#include <cstring>
+#include <cstddef>
+using namespace std;
+using namespace librf;
+
+struct FlatForestFixture {
+  FlatForestFixture() {
+    heart_ = InstanceSet::load_csv_and_labels("../data/heart.csv",
+                                           "../data/heart_labels.txt",true);
+  }
+  ~FlatForestFixture() {
+    delete heart_;
+  }
+  InstanceSet* heart_;
+};
+
+TEST_FIXTURE(FlatForestFixture, FlatPredictCheck) {
+  RandomForest rf(*heart_, 30, 4);
+  // also pack a forest that was loaded from disk
+  stringstream model;
+  rf.write(model);
+  RandomForest loaded;
+  loaded.read(model);
+  FlatForest flat(rf);
+  FlatForest flat_loaded(loaded);
+  CHECK_EQUAL(30, flat.num_trees());
+  CHECK_EQUAL(flat.num_split_nodes(), flat_loaded.num_split_nodes());
+  for (int i = 0; i < heart_->size(); ++i) {
+    CHECK_EQUAL(rf.predict(*heart_, i), flat.predict(*heart_, i));
+    CHECK_EQUAL(rf.predict_prob(*heart_, i, 1),
+                flat.predict_prob(*heart_, i, 1));
+    CHECK_EQUAL(rf.predict(*heart_, i), flat_loaded.predict(*heart_, i));
+  }
+  // a batch (over several blocks and threads) matches the single rows
+  int begin = 3, end = heart_->size();
+  vector<int> labels(end - begin);
+  vector<float> probs(end - begin);
+  flat.predict_batch(*heart_, begin, end, &labels[0], &probs[0], 1, 4);
+  for (int i = begin; i < end; ++i) {
+    CHECK_EQUAL(flat.predict(*heart_, i), labels[i - begin]);
+    CHECK_EQUAL(flat.predict_prob(*heart_, i, 1), probs[i - begin]);
+  }
+}
+
+TEST_FIXTURE(FlatForestFixture, BinaryModelCheck) {
+  RandomForest rf(*heart_, 30, 4);
+  stringstream model;
+  rf.write(model);
+  RandomForest loaded;
+  loaded.read(model);
+  FlatForest flat(loaded);
+  const char* filename = "flat_forest_unittest.model";
+  {
+    ofstream out(filename, ios::binary);
+    flat.write_binary(out);
+  }
+  CHECK(FlatForest::is_binary(filename));
+  FlatForest* mapped = FlatForest::load_binary(filename);
+  CHECK(mapped != NULL);
+  CHECK_EQUAL(flat.num_split_nodes(), mapped->num_split_nodes());
+  for (int i = 0; i < heart_->size(); ++i) {
+    CHECK_EQUAL(rf.predict(*heart_, i), mapped->predict(*heart_, i));
+    CHECK_EQUAL(rf.predict_prob(*heart_, i, 1),
+                mapped->predict_prob(*heart_, i, 1));
+  }
+  // back to text: nodes are numbered the way the tree builder does
+  stringstream text;
+  mapped->write_text(text);
+  CHECK(model.str() == text.str());
+  delete mapped;
+  // corrupted models are rejected rather than trusted
+  string bytes;
+  {
+    ifstream in(filename, ios::binary);
+    stringstream ss;
+    ss << in.rdbuf();
+    bytes = ss.str();
+  }
+  flat_forest_header header;
+  memcpy(&header, bytes.data(), sizeof(header));
+  int num_nodes = header.num_split_nodes;
+  size_t roots = sizeof(header);
+  size_t children = roots + (header.num_trees + 2 * num_nodes) * sizeof(int);
+  // (field, value): too many labels, a root past the nodes, a child
+  // pointing back at its parent
+  size_t fields[3] = {offsetof(flat_forest_header, num_labels), roots,
+                      children};
+  int values[3] = {300, num_nodes, 0};
+  for (int k = 0; k < 3; ++k) {
+    string bad = bytes;
+    memcpy(&bad[fields[k]], &values[k], sizeof(int));
+    {
+      ofstream out(filename, ios::binary);
+      out << bad;
+    }
+    CHECK(FlatForest::load_binary(filename) == NULL);
+  }
+  unlink(filename);
+  // a text model is not mistaken for a binary one
+  CHECK(FlatForest::load_binary("../data/heart_labels.txt") == NULL);
+}
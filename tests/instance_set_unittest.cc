@@ -1,6 +1,12 @@
 #include "librf/instance_set.h"
 #include <UnitTest++.h>
 #include <iostream>
+#include <fstream>
+#include <sstream>
+#include <cstring>
+#include <algorithm>
+#include <unistd.h>
+#include <stdlib.h>
 using namespace std;
 using namespace librf;
 struct InstanceSetFixture {
@@ -22,6 +28,333 @@ TEST_FIXTURE(InstanceSetFixture, SanityCheck)
   CHECK_EQUAL(csv->size(), 270);
 }
 
+TEST(CSVFormatCheck)
+{
+  // CRLF line ends, a blank line, no newline at the end
+  {
+    ofstream data("csv_format.csv", ios::binary);
+    data << "a;b;c\r\n" << "1;-2.5;0.125\r\n" << "\r\n"
+         << "1e-3;+7;3.14159265358979\r\n" << "-0;12345678;.5";
+    ofstream labels("csv_format_labels.txt");
+    labels << "0\n1\n1\n";
+  }
+  for (int threads = 1; threads <= 4; threads += 3) {
+    InstanceSet* set = InstanceSet::load_csv_and_labels("csv_format.csv",
+                                    "csv_format_labels.txt", true, ";",
+                                    threads);
+    CHECK_EQUAL(3, set->size());
+    CHECK_EQUAL(3, set->num_attributes());
+    CHECK_EQUAL("b", set->get_varname(1));
+    CHECK_EQUAL(-2.5f, set->get_attribute(0, 1));
+    CHECK_EQUAL(0.125f, set->get_attribute(0, 2));
+    CHECK_EQUAL(strtof("1e-3", NULL), set->get_attribute(1, 0));
+    CHECK_EQUAL(7.0f, set->get_attribute(1, 1));
+    CHECK_EQUAL(strtof("3.14159265358979", NULL), set->get_attribute(1, 2));
+    CHECK_EQUAL(12345678.0f, set->get_attribute(2, 1));
+    CHECK_EQUAL(0.5f, set->get_attribute(2, 2));
+    delete set;
+  }
+  unlink("csv_format.csv");
+  unlink("csv_format_labels.txt");
+}
+
+TEST(CSVEmptyFieldCheck)
+{
+  // empty fields are 0, even the last one of a line (not the first
+  // value of the next line)
+  {
+    ofstream data("csv_empty.csv");
+    data << "1,2,\n" << "3,4, \n" << "5,,6\n";
+    ofstream labels("csv_empty_labels.txt");
+    labels << "0\n1\n0\n";
+  }
+  InstanceSet* set = InstanceSet::load_csv_and_labels("csv_empty.csv",
+                                  "csv_empty_labels.txt", false, ",", 2);
+  CHECK(set != NULL);
+  CHECK_EQUAL(3, set->size());
+  CHECK_EQUAL(0.0f, set->get_attribute(0, 2));
+  CHECK_EQUAL(3.0f, set->get_attribute(1, 0));
+  CHECK_EQUAL(4.0f, set->get_attribute(1, 1));
+  CHECK_EQUAL(0.0f, set->get_attribute(1, 2));
+  CHECK_EQUAL(0.0f, set->get_attribute(2, 1));
+  CHECK_EQUAL(6.0f, set->get_attribute(2, 2));
+  delete set;
+  // a file of exactly one page ending in an empty field: nothing is
+  // read past the end of the mapping
+  int page = getpagesize();
+  int rows = page / 5;
+  {
+    ofstream data("csv_empty.csv");
+    ofstream labels("csv_empty_labels.txt");
+    data << "1" << string(page % 5, '0') << ",2,\n";
+    for (int i = 1; i < rows; ++i) {
+      data << "1,2,\n";
+    }
+    for (int i = 0; i < rows; ++i) {
+      labels << i % 2 << "\n";
+    }
+  }
+  set = InstanceSet::load_csv_and_labels("csv_empty.csv",
+                                         "csv_empty_labels.txt");
+  CHECK(set != NULL);
+  CHECK_EQUAL(rows, set->size());
+  CHECK_EQUAL(0.0f, set->get_attribute(rows - 1, 2));
+  delete set;
+  unlink("csv_empty.csv");
+  unlink("csv_empty_labels.txt");
+}
+
+TEST(CSVMalformedCheck)
+{
+  // a short line and a long line: both are rejected (not merged with
+  // the next line, or written past the counted rows)
+  const char* bad[] = {"1,2,3\n4,5\n6,7,8\n", "1,2,3\n4,5,6,7\n",
+                       "1,2,3\n4,5,6\n7"};
+  {
+    ofstream labels("csv_malformed_labels.txt");
+    labels << "0\n1\n0\n";
+  }
+  for (int k = 0; k < 3; ++k) {
+    {
+      ofstream data("csv_malformed.csv");
+      data << bad[k];
+    }
+    for (int threads = 1; threads <= 4; threads += 3) {
+      InstanceSet* set = InstanceSet::load_csv_and_labels("csv_malformed.csv",
+                                      "csv_malformed_labels.txt", false, ",",
+                                      threads);
+      CHECK(set == NULL);
+      delete set;
+    }
+  }
+  CHECK(InstanceSet::load_csv_and_labels("no_such_file.csv",
+                                         "csv_malformed_labels.txt") == NULL);
+  // a bad label, and one label too few
+  {
+    ofstream data("csv_malformed.csv");
+    data << "1,2\n3,4\n5,6\n";
+  }
+  const char* bad_labels[] = {"0\n2\n1\n", "0\n1\n"};
+  for (int k = 0; k < 2; ++k) {
+    {
+      ofstream labels("csv_malformed_labels.txt");
+      labels << bad_labels[k];
+    }
+    CHECK(InstanceSet::load_csv_and_labels("csv_malformed.csv",
+                                           "csv_malformed_labels.txt") == NULL);
+  }
+  unlink("csv_malformed.csv");
+  unlink("csv_malformed_labels.txt");
+}
+
+TEST(LibSVMCheck)
+{
+  {
+    ofstream data("libsvm_check.svm");
+    data << "+1 1:0.5 4:-2\n" << "\n" << "-1 2:3 3:0\n" << "0\n";
+  }
+  InstanceSet* set = InstanceSet::load_libsvm("libsvm_check.svm", 6);
+  CHECK(set->sparse());
+  CHECK_EQUAL(3, set->size());
+  CHECK_EQUAL(6, set->num_attributes());
+  CHECK_EQUAL(1, set->label(0));
+  CHECK_EQUAL(0, set->label(1));
+  CHECK_EQUAL(0.5f, set->get_attribute(0, 0));
+  CHECK_EQUAL(-2.0f, set->get_attribute(0, 3));
+  CHECK_EQUAL(0.0f, set->get_attribute(0, 1));
+  CHECK_EQUAL(3.0f, set->get_attribute(1, 1));
+  CHECK_EQUAL(0.0f, set->get_attribute(2, 5));
+  // explicit zeros are not stored
+  CHECK_EQUAL(0, set->nonzero_instances(2).size());
+  CHECK_EQUAL(1, set->nonzero_instances(1).size());
+  delete set;
+  // feature indices start at 1, labels are +1, 0 or -1
+  const char* bad[] = {"+1 1:0.5\n-1 0:3\n", "+1 1:0.5\n2 1:3\n", ""};
+  for (int k = 0; k < 3; ++k) {
+    {
+      ofstream data("libsvm_check.svm");
+      data << bad[k];
+    }
+    CHECK(InstanceSet::load_libsvm("libsvm_check.svm") == NULL);
+  }
+  unlink("libsvm_check.svm");
+}
+
+TEST_FIXTURE(InstanceSetFixture, ViewCheck)
+{
+  vector<int> attrs;
+  attrs.push_back(3);
+  attrs.push_back(0);
+  attrs.push_back(7);
+  InstanceSet* selected = InstanceSet::feature_select(*csv, attrs);
+  CHECK(selected->view());
+  CHECK_EQUAL(3, selected->num_attributes());
+  CHECK_EQUAL(csv->mode_label(), selected->mode_label());
+  for (int j = 0; j < attrs.size(); ++j) {
+    CHECK_EQUAL(csv->get_varname(attrs[j]), selected->get_varname(j));
+    // the sorted indices are shared, not copied
+    CHECK(csv->get_sorted_indices(attrs[j]) ==
+          selected->get_sorted_indices(j));
+    for (int i = 0; i < csv->size(); ++i) {
+      CHECK_EQUAL(csv->get_attribute(i, attrs[j]),
+                  selected->get_attribute(i, j));
+    }
+  }
+  delete selected;
+  // every third instance; a permuted attribute reads other rows
+  vector<int> rows;
+  for (int i = 0; i < csv->size(); i += 3) {
+    rows.push_back(i);
+  }
+  RowView view(*csv, rows);
+  CHECK_EQUAL(rows.size(), view.size());
+  Random rng(1);
+  view.permute(2, &rng);
+  float sum = 0, permuted_sum = 0;
+  for (int i = 0; i < view.size(); ++i) {
+    CHECK_EQUAL(csv->label(rows[i]), view.label(i));
+    CHECK_EQUAL(csv->get_attribute(rows[i], 1), view.get_attribute(i, 1));
+    sum += csv->get_attribute(rows[i], 2);
+    permuted_sum += view.get_attribute(i, 2);
+  }
+  CHECK_CLOSE(sum, permuted_sum, 1e-3);
+  view.restore();
+  CHECK_EQUAL(csv->get_attribute(rows[5], 2), view.get_attribute(5, 2));
+}
+
+TEST(SortedIndicesCheck)
+{
+  // negatives, -0 and +0, ties, large and tiny magnitudes
+  const float values[] = {3.5f, -0.0f, -1e-30f, 0.0f, 1e30f, -2.0f, 3.5f,
+                          -1e30f, 1e-30f, -2.0f, 0.0f, 7.0f};
+  const int n = sizeof(values) / sizeof(values[0]);
+  {
+    ofstream data("sorted_check.csv");
+    ofstream labels("sorted_check_labels.txt");
+    for (int i = 0; i < n; ++i) {
+      data << values[i] << "," << -values[i] << "\n";
+      labels << i % 2 << "\n";
+    }
+  }
+  InstanceSet* set = InstanceSet::load_csv_and_labels("sorted_check.csv",
+                                  "sorted_check_labels.txt", false, ",", 2);
+  for (int attr = 0; attr < 2; ++attr) {
+    vector<pair<float, int> > pairs;
+    for (int i = 0; i < n; ++i) {
+      pairs.push_back(make_pair(set->get_attribute(i, attr), i));
+    }
+    sort(pairs.begin(), pairs.end());
+    const int* sorted = set->get_sorted_indices(attr);
+    CHECK(sorted != NULL);
+    for (int i = 0; i < n; ++i) {
+      CHECK_EQUAL(pairs[i].second, sorted[i]);
+    }
+  }
+  delete set;
+  unlink("sorted_check.csv");
+  unlink("sorted_check_labels.txt");
+}
+
+TEST_FIXTURE(InstanceSetFixture, BinaryDataCheck)
+{
+  const char* filename = "instance_set_unittest.data";
+  {
+    ofstream out(filename, ios::binary);
+    csv->write_binary(out);
+  }
+  CHECK(InstanceSet::is_binary(filename));
+  CHECK(!InstanceSet::is_binary("../data/heart.csv"));
+  InstanceSet* set = InstanceSet::load_binary(filename);
+  CHECK(set != NULL);
+  CHECK_EQUAL(csv->size(), set->size());
+  CHECK_EQUAL(csv->num_attributes(), set->num_attributes());
+  CHECK_EQUAL(csv->mode_label(), set->mode_label());
+  for (int j = 0; j < csv->num_attributes(); ++j) {
+    CHECK_EQUAL(csv->get_varname(j), set->get_varname(j));
+    CHECK(equal(csv->get_sorted_indices(j),
+                csv->get_sorted_indices(j) + csv->size(),
+                set->get_sorted_indices(j)));
+    for (int i = 0; i < csv->size(); ++i) {
+      CHECK_EQUAL(csv->get_attribute(i, j), set->get_attribute(i, j));
+    }
+  }
+  for (int i = 0; i < csv->size(); ++i) {
+    CHECK_EQUAL(csv->label(i), set->label(i));
+  }
+  delete set;
+  // sample weights and bins are kept too
+  vector<float> weights(csv->size());
+  for (int i = 0; i < csv->size(); ++i) {
+    weights[i] = 0.5 + i % 3;
+  }
+  csv->set_weights(weights);
+  csv->create_bins(16);
+  {
+    ofstream out(filename, ios::binary);
+    csv->write_binary(out);
+  }
+  set = InstanceSet::load_binary(filename);
+  CHECK(set != NULL);
+  CHECK(set->weighted());
+  CHECK(set->binned());
+  for (int j = 0; j < csv->num_attributes(); ++j) {
+    CHECK_EQUAL(csv->num_bins(j), set->num_bins(j));
+    for (int b = 0; b + 1 < csv->num_bins(j); ++b) {
+      CHECK_EQUAL(csv->bin_cut(j, b), set->bin_cut(j, b));
+    }
+    for (int i = 0; i < csv->size(); ++i) {
+      CHECK_EQUAL(int(csv->get_bin(i, j)), int(set->get_bin(i, j)));
+    }
+  }
+  for (int i = 0; i < csv->size(); ++i) {
+    CHECK_EQUAL(weights[i], set->weight(i));
+  }
+  delete set;
+  // sparse sets keep their nonzeros only
+  {
+    ofstream data("binary_check.svm");
+    data << "+1 1:0.5 4:-2\n" << "-1 2:3\n";
+  }
+  InstanceSet* sparse = InstanceSet::load_libsvm("binary_check.svm", 5);
+  {
+    ofstream out(filename, ios::binary);
+    sparse->write_binary(out);
+  }
+  set = InstanceSet::load_binary(filename);
+  CHECK(set->sparse());
+  CHECK_EQUAL(5, set->num_attributes());
+  CHECK_EQUAL(-2.0f, set->get_attribute(0, 3));
+  CHECK_EQUAL(3.0f, set->get_attribute(1, 1));
+  CHECK_EQUAL(0, set->nonzero_instances(4).size());
+  delete set;
+  delete sparse;
+  unlink("binary_check.svm");
+  // truncated files, and sorted indices past the instances, are rejected
+  {
+    ofstream out(filename, ios::binary);
+    out.write("LRFD", 4);
+  }
+  CHECK(InstanceSet::load_binary(filename) == NULL);
+  {
+    stringstream data;
+    csv->write_binary(data);
+    string bytes = data.str();
+    // the last sorted index of the last attribute (4 byte sections:
+    // #cuts, then the cuts and bins of every attribute come after it)
+    size_t bins_bytes = csv->num_attributes() * sizeof(uint32);
+    for (int j = 0; j < csv->num_attributes(); ++j) {
+      bins_bytes += (csv->num_bins(j) - 1) * sizeof(float) +
+                    (csv->size() + 3) / 4 * 4;
+    }
+    int bad = csv->size();
+    memcpy(&bytes[bytes.size() - bins_bytes - sizeof(int)], &bad,
+           sizeof(bad));
+    ofstream out(filename, ios::binary);
+    out << bytes;
+  }
+  CHECK(InstanceSet::load_binary(filename) == NULL);
+  unlink(filename);
+}
 
 /*
 int main()
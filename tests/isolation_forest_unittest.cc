@@ -0,0 +1,89 @@
+#include "librf/instance_set.h"
+#include "librf/isolation_forest.h"
+#include "librf/tree.h"
+#include <UnitTest++.h>
+#include <iostream>
+#include <fstream>
+#include <unistd.h>
+using namespace std;
+using namespace librf;
+
+struct IsolationForestFixture {
+  IsolationForestFixture() {
+    heart_ = InstanceSet::load_csv_and_labels("../data/heart.csv",
+                                           "../data/heart_labels.txt",true);
+    // the heart data plus one instance far away from all of it
+    {
+      ofstream csv("isolation_check.csv");
+      heart_->write_csv(csv, false, ",");
+      for (int j = 0; j < heart_->num_attributes(); ++j) {
+        csv << (j > 0 ? "," : "") << 1000;
+      }
+      csv << endl;
+      ofstream labels("isolation_check_labels.txt");
+      for (int i = 0; i < heart_->size(); ++i) {
+        labels << int(heart_->label(i)) << endl;
+      }
+      labels << 0 << endl;
+    }
+    outlier_ = InstanceSet::load_csv_and_labels("isolation_check.csv",
+                                             "isolation_check_labels.txt");
+    unlink("isolation_check.csv");
+    unlink("isolation_check_labels.txt");
+  }
+  ~IsolationForestFixture() {
+    delete heart_;
+    delete outlier_;
+  }
+  InstanceSet* heart_;
+  InstanceSet* outlier_;
+};
+
+TEST(AveragePathLengthCheck) {
+  CHECK_EQUAL(0.0, Tree::average_path_length(1));
+  CHECK_EQUAL(1.0, Tree::average_path_length(2));
+  // 2 H(255) - 2 * 255 / 256
+  CHECK_CLOSE(10.24, Tree::average_path_length(256), 0.01);
+}
+
+TEST_FIXTURE(IsolationForestFixture, IsolationOutlierCheck) {
+  int n = outlier_->size();
+  CHECK_EQUAL(heart_->size() + 1, n);
+  IsolationForest forest(*outlier_, 100, 64);
+  CHECK_EQUAL(100, forest.num_trees());
+  vector<pair<float, int> > ranking;
+  forest.compute_outliers(*outlier_, &ranking);
+  CHECK_EQUAL(n, ranking.size());
+  // the planted instance comes first, and stands out
+  CHECK_EQUAL(n - 1, ranking[0].second);
+  CHECK(ranking[0].first > 0.7);
+  CHECK(ranking[n / 2].first < 0.6);
+  for (int i = 0; i < n; ++i) {
+    CHECK(ranking[i].first > 0 && ranking[i].first < 1);
+    if (i > 0) {
+      CHECK(ranking[i].first <= ranking[i - 1].first);
+    }
+  }
+  // no depth beyond log2(sample size)
+  for (int t = 0; t < 3; ++t) {
+    CHECK(forest.path_length(*outlier_, t) < 6 +
+          Tree::average_path_length(64));
+  }
+}
+
+TEST_FIXTURE(IsolationForestFixture, ThreadedIsolationCheck) {
+  IsolationForest serial(*outlier_, 40, 128);
+  IsolationForest threaded(*outlier_, 40, 128, -1, 3);
+  vector<pair<float, int> > serial_ranking, threaded_ranking;
+  serial.compute_outliers(*outlier_, &serial_ranking);
+  threaded.compute_outliers(*outlier_, &threaded_ranking, -1, 2);
+  CHECK(serial_ranking == threaded_ranking);
+  // only the first instances are sampled and scored
+  IsolationForest head(*outlier_, 40, 128, 100);
+  vector<pair<float, int> > head_ranking;
+  head.compute_outliers(*outlier_, &head_ranking, 100);
+  CHECK_EQUAL(100, head_ranking.size());
+  for (int i = 0; i < head_ranking.size(); ++i) {
+    CHECK(head_ranking[i].second < 100);
+  }
+}
@@ -1,8 +1,14 @@
 #include "librf/random_forest.h"
 #include "librf/instance_set.h"
+#include "librf/tree.h"
+#include "librf/proximity.h"
+#include "librf/weights.h"
 #include <UnitTest++.h>
 #include <iostream>
 #include <fstream>
+#include <sstream>
+#include <cstring>
+#include <unistd.h>
 using namespace std;
 using namespace librf;
 
@@ -41,6 +47,362 @@ TEST_FIXTURE(RF_TrainPredictFixture, TrainPredictCheck) {
     cout << heart_->get_varname(scores[i].second) << ":" << scores[i].first <<endl;
   }
 }
+TEST_FIXTURE(RF_TrainPredictFixture, ThreadedTrainCheck) {
+  // The same seed has to give the same forest, however many threads
+  RandomForest serial(*heart_, 20, 4, vector<float>(), 1, 7);
+  RandomForest threaded(*heart_, 20, 4, vector<float>(), 4, 7);
+  stringstream serial_model, threaded_model;
+  serial.write(serial_model);
+  threaded.write(threaded_model);
+  CHECK(serial_model.str() == threaded_model.str());
+  CHECK_EQUAL(serial.oob_accuracy(), threaded.oob_accuracy());
+}
+
+TEST_FIXTURE(RF_TrainPredictFixture, ThreadedImportanceCheck) {
+  // the ranking only depends on the seed
+  RandomForest rf(*heart_, 30, 4);
+  unsigned int serial_seed = 3;
+  unsigned int threaded_seed = 3;
+  vector< pair<float, int> > serial, threaded;
+  rf.variable_importance(&serial, &serial_seed, 1);
+  rf.variable_importance(&threaded, &threaded_seed, 4);
+  CHECK_EQUAL(heart_->num_attributes(), serial.size());
+  CHECK(serial == threaded);
+  CHECK_EQUAL(serial_seed, threaded_seed);
+}
+
+TEST_FIXTURE(RF_TrainPredictFixture, ImpurityImportanceCheck) {
+  RandomForest rf(*heart_, 30, 4);
+  const vector<float>& importance = rf.impurity_importance();
+  CHECK_EQUAL(heart_->num_attributes(), importance.size());
+  float sum = 0;
+  for (int j = 0; j < importance.size(); ++j) {
+    CHECK(importance[j] >= 0);
+    bool used = false;
+    for (int t = 0; t < rf.num_trees(); ++t) {
+      used = used || rf.tree(t).uses_var(j);
+    }
+    CHECK_EQUAL(used, importance[j] > 0);
+    sum += importance[j];
+  }
+  // can't remove more impurity than the root had (entropy <= 1 bit)
+  CHECK(sum > 0 && sum <= 1.0001);
+  // saved with the model
+  stringstream model;
+  rf.write(model);
+  RandomForest loaded;
+  loaded.read(model);
+  CHECK_EQUAL(importance.size(), loaded.impurity_importance().size());
+  for (int j = 0; j < importance.size(); ++j) {
+    CHECK_CLOSE(importance[j], loaded.impurity_importance()[j], 1e-5);
+  }
+}
+
+TEST_FIXTURE(RF_TrainPredictFixture, SparseProximityCheck) {
+  RandomForest rf(*heart_, 20, 4);
+  int n = heart_->size();
+  vector<vector<float> > dense(n, vector<float>(n, 0.0));
+  rf.compute_proximity(*heart_, &dense);
+  ProximityMatrix serial, threaded;
+  rf.compute_proximity(*heart_, &serial);
+  rf.compute_proximity(*heart_, &threaded, -1, 0, 3);
+  CHECK_EQUAL(n, serial.size());
+  CHECK_EQUAL(serial.num_entries(), threaded.num_entries());
+  size_t nonzeros = 0;
+  for (int i = 0; i < n; ++i) {
+    for (int j = 0; j < n; ++j) {
+      CHECK_EQUAL(dense[i][j], serial.get(i, j));
+      nonzeros += (dense[i][j] != 0);
+    }
+    CHECK(serial.row(i) == threaded.row(i));
+  }
+  CHECK_EQUAL(nonzeros, serial.num_entries());
+  // same outlier scores as from the dense matrix
+  vector<pair<float, int> > dense_outliers, sparse_outliers;
+  rf.compute_outliers(*heart_, 0, dense, &dense_outliers);
+  rf.compute_outliers(*heart_, 0, serial, &sparse_outliers);
+  CHECK(dense_outliers == sparse_outliers);
+  // top 5: the largest proximities of each row are kept
+  serial.keep_top(5);
+  ProximityMatrix top;
+  rf.compute_proximity(*heart_, &top, -1, 5, 2);
+  for (int i = 0; i < n; ++i) {
+    CHECK(serial.row(i) == top.row(i));
+    const vector<pair<int, float> >& row = serial.row(i);
+    CHECK(row.size() <= 5);
+    float smallest = 2;
+    for (int k = 0; k < row.size(); ++k) {
+      smallest = min(smallest, row[k].second);
+    }
+    for (int k = 0; k < threaded.row(i).size(); ++k) {
+      int j = threaded.row(i)[k].first;
+      if (serial.get(i, j) == 0) {
+        CHECK(threaded.row(i)[k].second <= smallest);
+      }
+    }
+  }
+}
+
+TEST_FIXTURE(RF_TrainPredictFixture, BaggingCheck) {
+  int n = heart_->size();
+  int label_count[2] = {0, 0};
+  for (int i = 0; i < n; ++i) {
+    label_count[heart_->label(i)]++;
+  }
+  bag_options subbag;
+  subbag.fraction = 0.2;
+  subbag.replacement = false;
+  bag_options stratified = subbag;
+  stratified.sampling = BAG_STRATIFIED;
+  bag_options balanced = subbag;
+  balanced.sampling = BAG_BALANCED;
+  RandomForest rf(*heart_, 10, 4, vector<float>(), 1, 1, ENTROPY, subbag);
+  RandomForest rf_stratified(*heart_, 10, 4, vector<float>(), 1, 1, ENTROPY,
+                             stratified);
+  RandomForest rf_balanced(*heart_, 10, 4, vector<float>(), 1, 1, ENTROPY,
+                           balanced);
+  for (int t = 0; t < 10; ++t) {
+    int in_bag = 0;
+    int stratified_count[2] = {0, 0};
+    int balanced_count[2] = {0, 0};
+    for (int i = 0; i < n; ++i) {
+      in_bag += !rf.tree(t).oob(i);
+      stratified_count[heart_->label(i)] += !rf_stratified.tree(t).oob(i);
+      balanced_count[heart_->label(i)] += !rf_balanced.tree(t).oob(i);
+    }
+    CHECK_EQUAL(int(0.2 * n + 0.5), in_bag);
+    for (int c = 0; c < 2; ++c) {
+      CHECK_EQUAL(int(0.2 * label_count[c] + 0.5), stratified_count[c]);
+      CHECK_EQUAL(int(0.2 * n / 2 + 0.5), balanced_count[c]);
+    }
+  }
+  // subbagged trees still predict well
+  CHECK(rf.oob_accuracy() > 0.7);
+}
+
+TEST_FIXTURE(RF_TrainPredictFixture, WeightedTrainCheck) {
+  int n = heart_->size();
+  // a single leaf (min_size n) takes the weighted mode of the labels
+  for (int c = 0; c < 2; ++c) {
+    vector<float> class_weights(2, 0.5);
+    class_weights[c] = 50.25;
+    weight_list* w = new weight_list(n, n);
+    for (int i = 0; i < n; ++i) {
+      w->add(i);
+    }
+    Tree leaf(*heart_, w, 4, n, 0, 1, ENTROPY, class_weights);
+    leaf.grow();
+    CHECK_EQUAL(1, leaf.num_nodes());
+    CHECK_EQUAL(c, leaf.predict(*heart_, 0));
+  }
+  vector<float> class_weights(2, 1);
+  class_weights[1] = 50;
+  RandomForest weighted(*heart_, 20, 4, class_weights);
+  CHECK(weighted.oob_accuracy() > 0.6);
+  // too few class weights: the other labels weigh 1
+  RandomForest padded(*heart_, 20, 4, vector<float>(1, 1));
+  RandomForest plain(*heart_, 20, 4);
+  for (int i = 0; i < n; ++i) {
+    CHECK_EQUAL(plain.predict(*heart_, i), padded.predict(*heart_, i));
+  }
+  // the same weights given per instance grow the same forest
+  vector<float> sample_weights(n);
+  for (int i = 0; i < n; ++i) {
+    sample_weights[i] = class_weights[heart_->label(i)];
+  }
+  heart_->set_weights(sample_weights);
+  RandomForest sampled(*heart_, 20, 4);
+  for (int i = 0; i < n; ++i) {
+    CHECK_EQUAL(weighted.predict(*heart_, i), sampled.predict(*heart_, i));
+  }
+}
+
+TEST_FIXTURE(RF_TrainPredictFixture, OOBVoteCheck) {
+  RandomForest rf(*heart_, 30, 4, vector<float>(), 2);
+  int correct = 0;
+  for (int i = 0; i < heart_->size(); ++i) {
+    // the recorded votes match the votes of the trees
+    int votes[2] = {0, 0};
+    for (int t = 0; t < rf.num_trees(); ++t) {
+      if (rf.tree(t).oob(i)) {
+        votes[rf.tree(t).predict(*heart_, i)]++;
+      }
+    }
+    int total = votes[0] + votes[1];
+    CHECK_EQUAL(total, rf.oob_vote_total(i));
+    if (total > 0) {
+      CHECK_EQUAL(float(votes[1]) / total, rf.oob_predict_prob(i, 1));
+    }
+    correct += ((votes[1] > votes[0]) == heart_->label(i));
+  }
+  CHECK_EQUAL(float(correct) / heart_->size(), rf.oob_accuracy());
+  // with a couple of trees some instances are never out of bag: they
+  // get no probability, and are left out of the reliability diagram
+  RandomForest few(*heart_, 2, 4);
+  int with_votes = 0;
+  for (int i = 0; i < heart_->size(); ++i) {
+    if (few.oob_vote_total(i) > 0) {
+      with_votes++;
+    } else {
+      CHECK_EQUAL(0.0, few.oob_predict_prob(i, 1));
+    }
+  }
+  CHECK(with_votes < heart_->size());
+  vector<pair<float, float> > diagram;
+  vector<int> counts;
+  few.reliability_diagram(10, &diagram, &counts, 1);
+  int counted = 0;
+  for (int b = 0; b < counts.size(); ++b) {
+    counted += counts[b];
+  }
+  CHECK_EQUAL(with_votes, counted);
+}
+
+TEST_FIXTURE(RF_TrainPredictFixture, ProximityFileCheck) {
+  RandomForest rf(*heart_, 20, 4);
+  const char* filename = "random_forest_unittest.prox";
+  int n = 200;
+  ProximityMatrix prox;
+  rf.compute_proximity(*heart_, &prox, n);
+  for (int format = PROXIMITY_FLOAT; format <= PROXIMITY_UINT16; ++format) {
+    CHECK(rf.write_proximity(*heart_, filename, n, format, 2));
+    ifstream in(filename, ios::binary);
+    proximity_file_header header;
+    in.read(reinterpret_cast<char*>(&header), sizeof(header));
+    CHECK(memcmp(header.magic, kProximityMagic, 4) == 0);
+    CHECK_EQUAL(1u, header.version);
+    CHECK_EQUAL(uint32(n), header.num_instances);
+    CHECK_EQUAL(uint32(format), header.format);
+    for (int i = 0; i < n; ++i) {
+      for (int j = 0; j < n; ++j) {
+        float value;
+        if (format == PROXIMITY_FLOAT) {
+          in.read(reinterpret_cast<char*>(&value), sizeof(value));
+        } else {
+          uint16 quantized;
+          in.read(reinterpret_cast<char*>(&quantized), sizeof(quantized));
+          value = quantized / 65535.0;
+        }
+        CHECK_CLOSE(prox.get(i, j), value, 1e-5);
+      }
+    }
+    // nothing past the last row
+    CHECK(in.peek() == EOF);
+  }
+  unlink(filename);
+}
+
+TEST_FIXTURE(RF_TrainPredictFixture, BatchPredictCheck) {
+  RandomForest rf(*heart_, 20, 4);
+  // start off a block boundary, so the last block is a partial one
+  int begin = 5;
+  int end = heart_->size();
+  vector<int> labels(end - begin);
+  vector<float> probs(end - begin);
+  rf.predict_batch(*heart_, begin, end, &labels[0], 4);
+  rf.predict_prob_batch(*heart_, begin, end, 1, &probs[0], 4);
+  for (int i = begin; i < end; ++i) {
+    CHECK_EQUAL(rf.predict(*heart_, i), labels[i - begin]);
+    CHECK_EQUAL(rf.predict_prob(*heart_, i, 1), probs[i - begin]);
+  }
+}
+
+TEST_FIXTURE(RF_TrainPredictFixture, RawPredictCheck) {
+  RandomForest rf(*heart_, 20, 4);
+  // row-major copy of the data, padded to show the stride is honored
+  int n = heart_->size();
+  int num_features = heart_->num_attributes();
+  int stride = num_features + 3;
+  vector<float> rows(n * stride, -1);
+  for (int i = 0; i < n; ++i) {
+    for (int j = 0; j < num_features; ++j) {
+      rows[i * stride + j] = heart_->get_attribute(i, j);
+    }
+  }
+  vector<int> labels(n);
+  vector<float> probs(n);
+  rf.predict_batch(&rows[0], n, num_features, stride, &labels[0], 2);
+  rf.predict_prob_batch(&rows[0], n, num_features, stride, 1, &probs[0]);
+  for (int i = 0; i < n; ++i) {
+    const float* row = &rows[i * stride];
+    CHECK_EQUAL(rf.predict(*heart_, i), rf.predict(row, num_features));
+    CHECK_EQUAL(rf.predict_prob(*heart_, i, 1),
+                rf.predict_prob(row, num_features, 1));
+    CHECK_EQUAL(rf.predict(*heart_, i), labels[i]);
+    CHECK_EQUAL(rf.predict_prob(*heart_, i, 1), probs[i]);
+  }
+}
+
+TEST_FIXTURE(RF_TrainPredictFixture, SparseTrainCheck) {
+  // shift a variable so there are negative values and zeros on both sides
+  vector<float> var;
+  heart_->save_var(3, &var);
+  for (int i = 0; i < var.size(); ++i) {
+    var[i] -= 130;
+  }
+  heart_->load_var(3, var);
+  // the same data, written densely and as libsvm
+  {
+    ofstream csv("sparse_train.csv");
+    heart_->write_csv(csv, false, ",");
+    ofstream labels("sparse_train_labels.txt");
+    ofstream svm("sparse_train.svm");
+    for (int i = 0; i < heart_->size(); ++i) {
+      labels << int(heart_->label(i)) << endl;
+      svm << int(heart_->label(i));
+      for (int j = 0; j < heart_->num_attributes(); ++j) {
+        if (heart_->get_attribute(i, j) != 0) {
+          svm << " " << j + 1 << ":" << heart_->get_attribute(i, j);
+        }
+      }
+      svm << endl;
+    }
+  }
+  InstanceSet* dense = InstanceSet::load_csv_and_labels("sparse_train.csv",
+                                          "sparse_train_labels.txt");
+  InstanceSet* sparse = InstanceSet::load_libsvm("sparse_train.svm");
+  CHECK(sparse->sparse());
+  CHECK_EQUAL(dense->num_attributes(), sparse->num_attributes());
+  CHECK_EQUAL(dense->size(), sparse->size());
+  // sorting only the nonzeros has to find the same splits
+  for (int K = 1; K <= 13; K += 6) {
+    RandomForest dense_rf(*dense, 20, K);
+    RandomForest sparse_rf(*sparse, 20, K);
+    stringstream dense_model, sparse_model;
+    dense_rf.write(dense_model);
+    sparse_rf.write(sparse_model);
+    CHECK(dense_model.str() == sparse_model.str());
+    CHECK_EQUAL(dense_rf.oob_accuracy(), sparse_rf.oob_accuracy());
+  }
+  delete dense;
+  delete sparse;
+  unlink("sparse_train.csv");
+  unlink("sparse_train_labels.txt");
+  unlink("sparse_train.svm");
+}
+
+TEST_FIXTURE(RF_TrainPredictFixture, BinnedTrainCheck) {
+  heart_->create_bins(32);
+  CHECK(heart_->binned());
+  for (int attr = 0; attr < heart_->num_attributes(); ++attr) {
+    CHECK(heart_->num_bins(attr) <= 32);
+    // bins have to agree with the cut points
+    for (int i = 0; i < heart_->size(); ++i) {
+      int bin = heart_->get_bin(i, attr);
+      float value = heart_->get_attribute(i, attr);
+      if (bin > 0) {
+        CHECK(value >= heart_->bin_cut(attr, bin - 1));
+      }
+      if (bin < heart_->num_bins(attr) - 1) {
+        CHECK(value < heart_->bin_cut(attr, bin));
+      }
+    }
+  }
+  RandomForest rf(*heart_, 50, 4);
+  CHECK(rf.oob_accuracy() > 0.7);
+  CHECK(rf.training_accuracy() > 0.9);
+}
+
 /*
 int main()
 {
@@ -0,0 +1,76 @@
+#include "librf/random.h"
+#include "librf/utils.h"
+#include <UnitTest++.h>
+#include <vector>
+using namespace std;
+using namespace librf;
+
+TEST(RandomStreamCheck) {
+  // a stream only depends on (seed, stream)
+  Random a(7, 3), b(7, 3), other(7, 4), derived(7, 3);
+  Random node = derived.stream(5);
+  derived.next64();
+  int same_other = 0;
+  for (int i = 0; i < 100; ++i) {
+    uint64 x = a.next64();
+    CHECK_EQUAL(x, b.next64());
+    same_other += (x == other.next64());
+  }
+  CHECK_EQUAL(0, same_other);
+  // derived streams don't depend on draws from their parent
+  Random node2 = Random(7, 3).stream(5);
+  CHECK_EQUAL(node.next64(), node2.next64());
+}
+
+TEST(RandomUniformCheck) {
+  Random rng(1);
+  // roughly uniform over a small range
+  vector<int> counts(10, 0);
+  for (int i = 0; i < 100000; ++i) {
+    counts[rng.uniform(10)]++;
+  }
+  for (int i = 0; i < 10; ++i) {
+    CHECK(counts[i] > 9500 && counts[i] < 10500);
+  }
+  // ranges beyond RAND_MAX
+  uint64 n = 5000000000ULL;
+  bool above = false;
+  for (int i = 0; i < 100; ++i) {
+    uint64 x = rng.uniform(n);
+    CHECK(x < n);
+    above = above || (x >= 2147483648ULL);
+  }
+  CHECK(above);
+  for (int i = 0; i < 1000; ++i) {
+    double x = rng.uniform_real();
+    CHECK(x >= 0 && x < 1);
+  }
+}
+
+TEST(RandomSampleCheck) {
+  Random rng(2);
+  vector<int> order(50);
+  for (int i = 0; i < 50; ++i) {
+    order[i] = i;
+  }
+  vector<int> hits(50, 0);
+  for (int round = 0; round < 2000; ++round) {
+    vector<int> sample;
+    random_sample(7, &order, &sample, &rng);
+    CHECK_EQUAL(7, sample.size());
+    vector<bool> seen(50, false);
+    for (int i = 0; i < sample.size(); ++i) {
+      CHECK(!seen[sample[i]]);
+      seen[sample[i]] = true;
+      hits[sample[i]]++;
+    }
+  }
+  // 2000 * 7 / 50 = 280 per value on average
+  for (int i = 0; i < 50; ++i) {
+    CHECK(hits[i] > 200 && hits[i] < 360);
+  }
+  // K >= n gives all of them
+  vector<int> all;
+  random_sample(60, &order, &all, &rng);
+  CHECK_EQUAL(50, all.size());
+}
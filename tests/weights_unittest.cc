@@ -1,7 +1,8 @@
-#include "weights.h"
+#include "librf/weights.h"
 #include <UnitTest++.h>
 #include <iostream>
 using namespace std;
+using namespace librf;
 
 TEST(WeightTest) {
   weight_list w(8,4);
@@ -14,3 +15,51 @@ TEST(WeightTest) {
   }
 
 }
+
+TEST(SparseWeightTest) {
+  // 3 adds * 5 bytes < 100 instances: stored sparsely
+  weight_list w(100, 3);
+  CHECK(w.sparse());
+  w.add(10, 2);
+  w.add(10);
+  w.add(42);
+  CHECK_EQUAL(4, w.sum());
+  CHECK_EQUAL(2, w.num_nonzero());
+  CHECK_EQUAL(3, int(w[10]));
+  CHECK_EQUAL(1, int(w[42]));
+  CHECK_EQUAL(0, int(w[0]));
+  CHECK_EQUAL(0, int(w[99]));
+  weight_list::const_iterator it = w.begin();
+  CHECK_EQUAL(10, it.instance());
+  CHECK_EQUAL(3, int(it.weight()));
+  ++it;
+  CHECK_EQUAL(42, it.instance());
+  ++it;
+  CHECK(it.done());
+  vector<int> zeros;
+  w.zeros(&zeros);
+  CHECK_EQUAL(98, int(zeros.size()));
+  CHECK_EQUAL(11, zeros[10]);
+  // same contents, stored densely
+  weight_list d(100, 100);
+  CHECK(!d.sparse());
+  d.add(42);
+  d.add(10, 3);
+  CHECK_EQUAL(2, d.num_nonzero());
+  vector<int> dense_zeros;
+  d.zeros(&dense_zeros);
+  CHECK(zeros == dense_zeros);
+}
+
+TEST(WeightOverflowTest) {
+  // multiplicities past a byte are kept on the side
+  weight_list w(10, 10);
+  w.add(3, 200);
+  w.add(3, 200);
+  w.add(4);
+  CHECK_EQUAL(400, int(w[3]));
+  CHECK_EQUAL(1, int(w[4]));
+  CHECK_EQUAL(401, w.sum());
+  weight_list::const_iterator it = w.begin();
+  CHECK_EQUAL(400, int(it.weight()));
+}